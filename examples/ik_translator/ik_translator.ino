@@ -33,7 +33,7 @@
 
 #include "Adafruit_TinyUSB.h"
 
-#include "Adafruit_IntelliKeys.h"
+#include "IKDeviceManager.h"
 
 // Pin D+ for host, D- = D+ + 1
 #ifndef PIN_USB_HOST_DP
@@ -62,7 +62,9 @@
 // USB Host object
 Adafruit_USBH_Host USBHost;
 
-Adafruit_IntelliKeys IKeys;
+// up to IK_MAX_DEVICES IntelliKeys (e.g behind a hub) merged into one
+// keyboard and mouse
+IKDeviceManager IKeys;
 
 // HID report descriptor for keyboard and mouse
 // Single Report (no ID) descriptor
@@ -129,8 +131,7 @@ bool hasKeyboardReport(hid_keyboard_report_t const *report) {
 }
 
 void scanMembraneAndSwitch(void) {
-  static hid_keyboard_report_t kb_prev_report = {0, 0, {0}};
-  static bool kb_has_prev_report = false;
+  static uint32_t report_seq = 0;
   static uint8_t mouse_prev_buttons = 0;
 
   if (!IKeys.isAttached()) {
@@ -148,29 +149,20 @@ void scanMembraneAndSwitch(void) {
   hid_keyboard_report_t kb_report;
   hid_mouse_report_t mouse_report;
 
-  IKeys.getHIDReport(&kb_report, &mouse_report);
+  // sequence number only changes when keyboard/mouse report is changed
+  uint32_t const seq = IKeys.getHIDReport(&kb_report, &mouse_report);
+  bool const changed = (seq != report_seq);
+  report_seq = seq;
 
   //------------- Keyboard -------------//
-  bool new_kb_report = hasKeyboardReport(&kb_report);
+  if (changed) {
+    usb_keyboard.sendReport(0, &kb_report, sizeof(kb_report));
+  }
 
-  if (new_kb_report) {
-    if (memcmp(&kb_prev_report, &kb_report, sizeof(kb_report))) {
-      // send only if kb_report is changed since last time
-      usb_keyboard.sendReport(0, &kb_report, sizeof(kb_report));
-    }
-    kb_has_prev_report = true;
+  if (hasKeyboardReport(&kb_report)) {
     color = COLOR_KEY_PRESSED;
-  } else {
-    if (kb_has_prev_report) {
-      // has previous report before, send empty kb_report to release all keys
-      hid_keyboard_report_t null_report = {0, 0, {0}};
-      usb_keyboard.sendReport(0, &null_report, sizeof(null_report));
-    }
-    kb_has_prev_report = false;
   }
 
-  kb_prev_report = kb_report;
-
   //------------- Mouse -------------//
   if (mouse_report.buttons != mouse_prev_buttons || mouse_report.x != 0 ||
       mouse_report.y != 0) {
@@ -272,6 +264,12 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance,
   IKeys.hid_reprot_received_cb(dev_addr, instance, report, len);
 }
 
+// Invoked when sent report to device successfully via interrupt endpoint
+void tuh_hid_report_sent_cb(uint8_t dev_addr, uint8_t instance,
+                            uint8_t const *report, uint16_t len) {
+  IKeys.hid_report_sent_cb(dev_addr, instance, report, len);
+}
+
 } // extern C
 
 //--------------------------------------------------------------------+
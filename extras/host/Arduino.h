@@ -0,0 +1,58 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Stand-in for the Arduino core in the host (Linux) build. millis() is driven
+// by a virtual clock so that time-dependent code (overlay settling, delays,
+// periodic correction) is deterministic, see host_shim.h
+
+#ifndef ADAFRUIT_INTELLIKEYS_HOST_ARDUINO_H
+#define ADAFRUIT_INTELLIKEYS_HOST_ARDUINO_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+
+class HostSerial {
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  void flush(void) { fflush(stdout); }
+  operator bool() { return true; }
+
+  int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  size_t print(const char *str) { return printf("%s", str); }
+  size_t println(const char *str) { return printf("%s\r\n", str); }
+
+  // Output is dropped unless enabled (or IK_HOST_VERBOSE is set in env)
+  bool enabled;
+};
+
+extern HostSerial Serial;
+
+#endif // ADAFRUIT_INTELLIKEYS_HOST_ARDUINO_H
@@ -0,0 +1,305 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "host_shim.h"
+
+//--------------------------------------------------------------------+
+// Arduino
+//--------------------------------------------------------------------+
+
+HostSerial Serial = {getenv("IK_HOST_VERBOSE") != NULL};
+
+static uint64_t _micros = 0;
+
+uint32_t millis(void) { return (uint32_t)(_micros / 1000); }
+uint32_t micros(void) { return (uint32_t)_micros; }
+void delay(uint32_t ms) { _micros += (uint64_t)ms * 1000; }
+
+void host_millis_set(uint32_t ms) { _micros = (uint64_t)ms * 1000; }
+void host_millis_advance(uint32_t ms) { _micros += (uint64_t)ms * 1000; }
+void host_micros_advance(uint32_t us) { _micros += us; }
+
+int HostSerial::printf(const char *format, ...) {
+  if (!enabled) {
+    return 0;
+  }
+
+  va_list ap;
+  va_start(ap, format);
+  int count = vprintf(format, ap);
+  va_end(ap);
+
+  return count;
+}
+
+//--------------------------------------------------------------------+
+// FIFO
+//--------------------------------------------------------------------+
+
+bool tu_fifo_config(tu_fifo_t *f, void *buffer, uint16_t depth,
+                    uint16_t item_size, bool overwritable) {
+  f->buffer = (uint8_t *)buffer;
+  f->depth = depth;
+  f->item_size = item_size;
+  f->overwritable = overwritable;
+  f->wr_idx = f->rd_idx = f->count = 0;
+  return true;
+}
+
+void tu_fifo_config_mutex(tu_fifo_t *f, osal_mutex_t wr_mutex,
+                          osal_mutex_t rd_mutex) {
+  (void)f;
+  (void)wr_mutex;
+  (void)rd_mutex;
+}
+
+bool tu_fifo_write(tu_fifo_t *f, void const *data) {
+  if (f->count == f->depth) {
+    if (!f->overwritable) {
+      return false;
+    }
+    f->rd_idx = (uint16_t)((f->rd_idx + 1) % f->depth);
+    f->count--;
+  }
+
+  memcpy(f->buffer + f->wr_idx * f->item_size, data, f->item_size);
+  f->wr_idx = (uint16_t)((f->wr_idx + 1) % f->depth);
+  f->count++;
+
+  return true;
+}
+
+bool tu_fifo_peek(tu_fifo_t *f, void *p_buffer) {
+  if (f->count == 0) {
+    return false;
+  }
+
+  memcpy(p_buffer, f->buffer + f->rd_idx * f->item_size, f->item_size);
+  return true;
+}
+
+bool tu_fifo_read(tu_fifo_t *f, void *buffer) {
+  if (!tu_fifo_peek(f, buffer)) {
+    return false;
+  }
+
+  f->rd_idx = (uint16_t)((f->rd_idx + 1) % f->depth);
+  f->count--;
+
+  return true;
+}
+
+bool tu_fifo_clear(tu_fifo_t *f) {
+  f->wr_idx = f->rd_idx = f->count = 0;
+  return true;
+}
+
+uint16_t tu_fifo_count(tu_fifo_t *f) { return f->count; }
+uint16_t tu_fifo_remaining(tu_fifo_t *f) { return f->depth - f->count; }
+bool tu_fifo_empty(tu_fifo_t *f) { return f->count == 0; }
+bool tu_fifo_full(tu_fifo_t *f) { return f->count == f->depth; }
+
+//--------------------------------------------------------------------+
+// Host stack
+//--------------------------------------------------------------------+
+
+// attached devices indexed by address, vid 0 is not attached. Each has one
+// HID OUT report in flight, completed by tuh_task()
+typedef struct {
+  uint16_t vid;
+  uint16_t pid;
+  bool out_busy;
+  uint8_t out_report[64];
+  uint16_t out_len;
+} host_device_t;
+
+static host_device_t _devices[HOST_MAX_DEVICES + 1];
+
+static host_hid_out_cb_t _hid_out_cb;
+static host_control_cb_t _control_cb;
+static host_usb_stats_t _stats;
+
+// asynchronous control transfer, completed by tuh_task()
+static bool _ctrl_busy;
+static tuh_xfer_t _ctrl_xfer;
+static tusb_control_request_t _ctrl_request;
+
+static host_device_t *get_device(uint8_t daddr) {
+  if (daddr == 0 || daddr > HOST_MAX_DEVICES || _devices[daddr].vid == 0) {
+    return NULL;
+  }
+  return &_devices[daddr];
+}
+
+void host_device_set(uint8_t daddr, uint16_t vid, uint16_t pid) {
+  if (daddr == 0 || daddr > HOST_MAX_DEVICES) {
+    return;
+  }
+
+  host_device_t *dev = &_devices[daddr];
+  dev->vid = vid;
+  dev->pid = pid;
+  dev->out_busy = false;
+
+  if (_ctrl_busy && _ctrl_xfer.daddr == daddr) {
+    _ctrl_busy = false;
+  }
+}
+
+void host_set_hid_out_cb(host_hid_out_cb_t cb) { _hid_out_cb = cb; }
+void host_set_control_cb(host_control_cb_t cb) { _control_cb = cb; }
+
+host_usb_stats_t const *host_usb_stats(void) { return &_stats; }
+void host_usb_stats_reset(void) { memset(&_stats, 0, sizeof(_stats)); }
+
+void tuh_task(void) {
+  if (_ctrl_busy) {
+    _ctrl_busy = false;
+    _ctrl_xfer.complete_cb(&_ctrl_xfer);
+  }
+
+  for (uint8_t daddr = 1; daddr <= HOST_MAX_DEVICES; daddr++) {
+    host_device_t *dev = &_devices[daddr];
+    if (!dev->out_busy) {
+      continue;
+    }
+
+    dev->out_busy = false;
+    if (tuh_hid_report_sent_cb) {
+      tuh_hid_report_sent_cb(daddr, 0, dev->out_report, dev->out_len);
+    }
+  }
+}
+
+bool tuh_vid_pid_get(uint8_t daddr, uint16_t *vid, uint16_t *pid) {
+  host_device_t const *dev = get_device(daddr);
+  if (dev == NULL) {
+    *vid = *pid = 0;
+    return false;
+  }
+
+  *vid = dev->vid;
+  *pid = dev->pid;
+  return true;
+}
+
+bool tuh_control_xfer(tuh_xfer_t *xfer) {
+  tusb_control_request_t const *request = xfer->setup;
+
+  // only one control transfer at a time
+  if (_ctrl_busy) {
+    return false;
+  }
+
+  _stats.control_xfer++;
+  _stats.control_bytes += request->wLength;
+
+  bool ok = (get_device(xfer->daddr) != NULL);
+  if (ok && _control_cb) {
+    ok = _control_cb(xfer->daddr, request, xfer->buffer);
+  }
+
+  xfer->result = ok ? XFER_RESULT_SUCCESS : XFER_RESULT_FAILED;
+  xfer->actual_len = ok ? request->wLength : 0;
+
+  // like the host stack, setup is copied and completion is deferred
+  if (xfer->complete_cb) {
+    _ctrl_request = *request;
+    _ctrl_xfer = *xfer;
+    _ctrl_xfer.setup = &_ctrl_request;
+    _ctrl_busy = true;
+  }
+
+  return true;
+}
+
+bool tuh_interface_set(uint8_t daddr, uint8_t itf_num, uint8_t itf_alt,
+                       tuh_xfer_cb_t complete_cb, uintptr_t user_data) {
+  tusb_control_request_t const request = {
+      .bmRequestType_bit = {.recipient = TUSB_REQ_RCPT_INTERFACE,
+                            .type = TUSB_REQ_TYPE_STANDARD,
+                            .direction = TUSB_DIR_OUT},
+      .bRequest = 0x0B, // SET_INTERFACE
+      .wValue = tu_htole16(itf_alt),
+      .wIndex = tu_htole16(itf_num),
+      .wLength = 0,
+  };
+
+  tuh_xfer_t xfer;
+  memset(&xfer, 0, sizeof(xfer));
+  xfer.daddr = daddr;
+  xfer.ep_addr = 0;
+  xfer.setup = &request;
+  xfer.buffer = NULL;
+  xfer.complete_cb = complete_cb;
+  xfer.user_data = user_data;
+
+  bool const ret = tuh_control_xfer(&xfer);
+
+  // blocking mode: result is written to user_data
+  if (complete_cb == NULL && user_data) {
+    *((xfer_result_t *)user_data) = (xfer_result_t)xfer.result;
+  }
+
+  return ret;
+}
+
+bool tuh_hid_receive_report(uint8_t dev_addr, uint8_t idx) {
+  (void)idx;
+  _stats.hid_in_armed++;
+  return get_device(dev_addr) != NULL;
+}
+
+bool tuh_hid_send_ready(uint8_t dev_addr, uint8_t idx) {
+  (void)idx;
+  host_device_t const *dev = get_device(dev_addr);
+  return dev != NULL && !dev->out_busy;
+}
+
+bool tuh_hid_send_report(uint8_t dev_addr, uint8_t idx, uint8_t report_id,
+                         void const *report, uint16_t len) {
+  (void)idx;
+  (void)report_id;
+
+  host_device_t *dev = get_device(dev_addr);
+  if (dev == NULL) {
+    return false;
+  }
+
+  if (dev->out_busy) {
+    _stats.hid_out_busy++;
+    return false;
+  }
+
+  dev->out_busy = true;
+  dev->out_len = len < sizeof(dev->out_report) ? len : sizeof(dev->out_report);
+  memcpy(dev->out_report, report, dev->out_len);
+
+  _stats.hid_out++;
+  if (_hid_out_cb) {
+    _hid_out_cb(dev_addr, (uint8_t const *)report, len);
+  }
+
+  return true;
+}
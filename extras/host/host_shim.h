@@ -0,0 +1,73 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Controls for the Arduino/TinyUSB shim used by the host (Linux) build. The
+// shim plays the role of the USB host stack: OUT reports and control transfers
+// issued by the library are counted and forwarded to optional hooks, so that
+// an executable can act as the IntelliKeys device.
+
+#ifndef ADAFRUIT_INTELLIKEYS_HOST_SHIM_H
+#define ADAFRUIT_INTELLIKEYS_HOST_SHIM_H
+
+#include "Arduino.h"
+#include "tusb.h"
+
+// device addresses 1 to HOST_MAX_DEVICES can be attached
+#define HOST_MAX_DEVICES 8
+
+typedef struct {
+  uint32_t control_xfer;  // number of control transfers
+  uint32_t control_bytes; // number of bytes in control data stage
+  uint32_t hid_out;       // number of HID OUT reports sent
+  uint32_t hid_out_busy;  // tuh_hid_send_report() rejected, endpoint busy
+  uint32_t hid_in_armed;  // number of tuh_hid_receive_report() calls
+} host_usb_stats_t;
+
+// Invoked for every HID OUT report sent with tuh_hid_send_report(). Like the
+// interrupt endpoint, only one OUT report is in flight: it completes on the
+// next tuh_task() which then invokes tuh_hid_report_sent_cb()
+typedef void (*host_hid_out_cb_t)(uint8_t daddr, uint8_t const *report,
+                                  uint16_t len);
+
+// Invoked for every control transfer, return false to fail the transfer. An
+// asynchronous transfer (with complete_cb) completes on the next tuh_task()
+typedef bool (*host_control_cb_t)(uint8_t daddr,
+                                  tusb_control_request_t const *request,
+                                  uint8_t *buffer);
+
+//------------- virtual clock -------------//
+void host_millis_set(uint32_t ms);
+void host_millis_advance(uint32_t ms);
+void host_micros_advance(uint32_t us);
+
+//------------- usb -------------//
+// attach (or change) device at address, vid 0 to detach
+void host_device_set(uint8_t daddr, uint16_t vid, uint16_t pid);
+void host_set_hid_out_cb(host_hid_out_cb_t cb);
+void host_set_control_cb(host_control_cb_t cb);
+
+host_usb_stats_t const *host_usb_stats(void);
+void host_usb_stats_reset(void);
+
+#endif // ADAFRUIT_INTELLIKEYS_HOST_SHIM_H
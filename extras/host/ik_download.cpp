@@ -0,0 +1,351 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Download the EZ-USB firmware to an emulated AN2131 and check the resulting
+// 8051 RAM against the hex records. Control transfers advance the virtual clock
+// following a simple bus model, so that the reported download time can be
+// compared between download strategies. With -c the n-th data write is
+// corrupted, which a build with IK_EZUSB_VERIFY must detect and retry.
+//
+// Then the device is re-enumerated with running firmware to check the cold,
+// warm and unknown firmware startup paths. Last, two devices download at the
+// same time behind IKDeviceManager, sharing the control endpoint.
+//
+// usage: ik_download [-t us per transfer] [-p us per 64-byte packet]
+//                    [-c n-th write to corrupt]
+
+#include <unistd.h>
+
+#include "Adafruit_IntelliKeys.h"
+#include "IKDeviceManager.h"
+#include "host_shim.h"
+
+#include "ik_firmware.h"
+#include "ik_loader.h"
+
+#define DADDR 1
+
+// downloading together behind the device manager
+#define MULTI_DADDR1 2
+#define MULTI_DADDR2 3
+
+static Adafruit_IntelliKeys IKeys;
+static IKDeviceManager IKManager;
+
+// bus model: control transfer overhead (setup + status) and data packet time
+static uint32_t xfer_us = 1000;
+static uint32_t packet_us = 60;
+static uint32_t corrupt_write = 0;
+
+//--------------------------------------------------------------------+
+// Emulated EZ-USB
+//--------------------------------------------------------------------+
+
+typedef struct {
+  uint8_t ram[0x10000];
+  bool in_reset;
+  uint32_t writes;
+} ezusb_t;
+
+static ezusb_t ezusb_devices[HOST_MAX_DEVICES + 1]; // by device address
+static uint32_t ezusb_errors;
+
+static bool ezusb_error(tusb_control_request_t const *request,
+                        const char *msg) {
+  printf("request %02x at 0x%04x (%u bytes): %s\n", request->bRequest,
+         request->wValue, request->wLength, msg);
+  ezusb_errors++;
+  return false;
+}
+
+static bool ezusb_control_cb(uint8_t daddr,
+                             tusb_control_request_t const *request,
+                             uint8_t *buffer) {
+  ezusb_t &ezusb = ezusb_devices[daddr];
+
+  host_micros_advance(xfer_us + packet_us * ((request->wLength + 63) / 64));
+
+  if (request->bmRequestType_bit.type != TUSB_REQ_TYPE_VENDOR) {
+    return true; // set interface
+  }
+
+  uint16_t const addr = request->wValue;
+  uint16_t const len = request->wLength;
+
+  if (len > IK_EZUSB_MAX_XFER) {
+    return ezusb_error(request, "transfer too large");
+  }
+
+  if (request->bRequest == ANCHOR_LOAD_INTERNAL) {
+    if (addr == CPUCS_REG && len == 1) {
+      ezusb.in_reset = buffer[0] & 0x01;
+      return true;
+    }
+
+    if (!INTERNAL_RAM(addr + len - 1)) {
+      return ezusb_error(request, "internal load beyond internal ram");
+    }
+
+    if (!ezusb.in_reset) {
+      return ezusb_error(request, "internal load while 8051 is running");
+    }
+  } else if (request->bRequest == ANCHOR_LOAD_EXTERNAL) {
+    // implemented by the loader firmware
+    if (INTERNAL_RAM(addr) || addr + len > 0x10000) {
+      return ezusb_error(request, "external load outside external ram");
+    }
+
+    if (ezusb.in_reset) {
+      return ezusb_error(request, "external load without running loader");
+    }
+  } else {
+    return ezusb_error(request, "unknown request");
+  }
+
+  if (request->bmRequestType_bit.direction == TUSB_DIR_IN) {
+    memcpy(buffer, ezusb.ram + addr, len); // upload
+    return true;
+  }
+
+  memcpy(ezusb.ram + addr, buffer, len);
+  if (++ezusb.writes == corrupt_write) {
+    ezusb.ram[addr] ^= 0x01;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------+
+// Running firmware
+//--------------------------------------------------------------------+
+
+static bool version_requested;
+
+static void hid_out_cb(uint8_t daddr, uint8_t const *report, uint16_t len) {
+  (void)daddr;
+  (void)len;
+  if (report[0] == IK_CMD_GET_VERSION) {
+    version_requested = true;
+  }
+}
+
+// Re-enumerate as running firmware, wait for version request and reply it
+static void start_running(uint8_t major, uint8_t minor) {
+  IKeys.umount(DADDR);
+  host_device_set(DADDR, IK_VID, IK_PID_RUNNING);
+  IKeys.mount(DADDR);
+
+  version_requested = false;
+  for (uint32_t i = 0; i < 1000 && !version_requested; i++) {
+    host_millis_advance(1);
+    tuh_task();
+    IKeys.Periodic();
+  }
+
+  uint8_t report[IK_REPORT_LEN] = {IK_EVENT_VERSION, major, minor};
+  IKeys.hid_reprot_received_cb(DADDR, 0, report, IK_REPORT_LEN);
+  IKeys.Periodic(); // decode it
+}
+
+static bool check_startup(void) {
+  ik_startup_stats_t const *startup = IKeys.getStartupStats();
+
+  start_running(1, 5);
+  if (startup->cold_count != 1) {
+    printf("startup: cold start not recorded\n");
+    return false;
+  }
+
+  // warm device running our firmware: no download
+  uint32_t const xfer = host_usb_stats()->control_xfer;
+  start_running(1, 5);
+  if (startup->warm_count != 1 || host_usb_stats()->control_xfer != xfer) {
+    printf("startup: warm start downloaded firmware\n");
+    return false;
+  }
+
+  // warm device running other firmware: download again
+  start_running(1, 4);
+  if (host_usb_stats()->control_xfer == xfer) {
+    printf("startup: unknown firmware not replaced\n");
+    return false;
+  }
+
+  // unplugged during that download: startup is abandoned, the next device
+  // is a warm start and not the end of the download
+  IKeys.Periodic();
+  IKeys.umount(DADDR);
+  if (IKeys.IsStartPending()) {
+    printf("startup: still pending after unplug during download\n");
+    return false;
+  }
+
+  ik_startup_stats_t const before = *startup;
+  start_running(1, 5);
+  if (startup->cold_count != before.cold_count ||
+      startup->warm_count != before.warm_count + 1) {
+    printf("startup: device after abandoned download not a warm start\n");
+    return false;
+  }
+
+  printf("cold start          : %u us\n", startup->cold_us);
+  printf("warm start          : %u us\n", startup->warm_us);
+  return true;
+}
+
+//--------------------------------------------------------------------+
+// Main
+//--------------------------------------------------------------------+
+
+static void apply_hex(uint8_t *ram, INTEL_HEX_RECORD const *record) {
+  for (; record->Type == 0; record++) {
+    memcpy(ram + record->Address, record->Data, record->Length);
+  }
+}
+
+// Compare 8051 ram of a device with the hex records, return mismatch count
+static uint32_t check_ram(uint8_t daddr) {
+  // loader is overwritten by the firmware where they overlap
+  static uint8_t expected[0x10000];
+  static bool expected_ready = false;
+  if (!expected_ready) {
+    apply_hex(expected, ik_loader);
+    apply_hex(expected, ik_firmware);
+    expected_ready = true;
+  }
+
+  uint8_t const *ram = ezusb_devices[daddr].ram;
+  uint32_t mismatch = 0;
+  for (uint32_t addr = 0; addr < sizeof(expected); addr++) {
+    if (ram[addr] != expected[addr]) {
+      if (mismatch++ < 8) {
+        printf("device %u ram 0x%04x: expected %02x, got %02x\n", daddr,
+               addr, expected[addr], ram[addr]);
+      }
+    }
+  }
+  return mismatch;
+}
+
+// Only one control transfer is in flight on the bus: a download whose
+// transfer is rejected must retry it instead of failing
+static bool check_multi_download(void) {
+  uint8_t const daddrs[] = {MULTI_DADDR1, MULTI_DADDR2};
+
+  IKManager.begin();
+  for (uint8_t daddr : daddrs) {
+    host_device_set(daddr, IK_VID, IK_PID_FWLOAD);
+    IKManager.mount(daddr);
+  }
+
+  bool done = false;
+  for (uint32_t i = 0; i < 20000 && !done; i++) {
+    host_millis_advance(1);
+    tuh_task();
+    IKManager.Periodic();
+
+    done = true;
+    for (uint8_t daddr : daddrs) {
+      done = done && IKManager.getDevice(daddr)->getDownloadTime() != 0;
+    }
+  }
+
+  bool ok = true;
+  for (uint8_t daddr : daddrs) {
+    Adafruit_IntelliKeys *dev = IKManager.getDevice(daddr);
+    if (dev->getDownloadTime() == 0) {
+      printf("multi: download of device %u did not complete, %u transfers\n",
+             daddr, dev->getDownloadStats()->xfer_count);
+      ok = false;
+    } else if (check_ram(daddr)) {
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    printf("multi download      : %u + %u transfers\n",
+           IKManager.getDevice(MULTI_DADDR1)->getDownloadStats()->xfer_count,
+           IKManager.getDevice(MULTI_DADDR2)->getDownloadStats()->xfer_count);
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:p:c:")) != -1) {
+    switch (opt) {
+    case 't':
+      xfer_us = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+
+    case 'p':
+      packet_us = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+
+    case 'c':
+      corrupt_write = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+
+    default:
+      printf("usage: %s [-t us per transfer] [-p us per packet] [-c n]\n",
+             argv[0]);
+      return 2;
+    }
+  }
+
+  host_set_control_cb(ezusb_control_cb);
+  host_set_hid_out_cb(hid_out_cb);
+  host_device_set(DADDR, IK_VID, IK_PID_FWLOAD);
+
+  IKeys.begin();
+  IKeys.mount(DADDR);
+
+  // download runs from Periodic(), one control transfer per tuh_task()
+  for (uint32_t i = 0; i < 10000 && IKeys.getDownloadTime() == 0; i++) {
+    tuh_task();
+    IKeys.Periodic();
+  }
+
+  if (IKeys.getDownloadTime() == 0) {
+    printf("download did not complete\n");
+    return 1;
+  }
+
+  uint32_t const mismatch = check_ram(DADDR);
+
+  host_usb_stats_t const *stats = host_usb_stats();
+  ik_download_stats_t const *dl = IKeys.getDownloadStats();
+
+  printf("control transfers   : %u\n", stats->control_xfer);
+  printf("control bytes       : %u\n", stats->control_bytes);
+  printf("download time       : %u us (modeled)\n", dl->total_us);
+  printf("verify time         : %u us, %u reads, %u retries\n", dl->verify_us,
+         dl->verify_count, dl->retry_count);
+  printf("ram mismatch        : %u bytes\n", mismatch);
+
+  if (mismatch || ezusb_errors) {
+    return 1;
+  }
+
+  return (check_startup() && check_multi_download() && !ezusb_errors) ? 0 : 1;
+}
@@ -0,0 +1,380 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Compare interrupt (auto) and polled event mode against an emulated device
+// that queues typing and sensor noise events. Every 1 ms frame runs
+// tuh_task(), at most one interrupt IN report and Periodic() like loop1().
+// CPU load is the host time spent in the driver per second of virtual time,
+// latency is the virtual time from an event occurring on the device until
+// the driver decodes it (membrane callback).
+//
+// usage: ik_event_bench [-t seconds] [-k keys/s] [-s sensor events/s]
+//   exit with error if a membrane event is lost. The bus carries one event
+//   per frame, beyond that events pile up on the device and show as latency
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <unistd.h>
+#include <vector>
+
+#include "Adafruit_IntelliKeys.h"
+#include "host_shim.h"
+
+#define DADDR 1
+
+typedef std::chrono::steady_clock bench_clock;
+
+typedef struct {
+  uint8_t report[IK_REPORT_LEN];
+  uint64_t time_us; // when it occurred on the device
+} dev_event_t;
+
+static Adafruit_IntelliKeys *ik;
+static uint64_t now_us;
+
+//------------- emulated device -------------//
+static std::multimap<uint64_t, dev_event_t> dev_schedule; // not occurred yet
+static std::deque<dev_event_t> dev_events;                // held by device
+static std::deque<dev_event_t> dev_replies; // replies to commands
+static bool dev_get_event;                  // IK_CMD_GET_EVENT pending
+static uint8_t dev_mode;
+static uint32_t dev_membrane[IK_RESOLUTION_Y];
+
+//------------- measurement -------------//
+// occurrence time of membrane events not decoded yet, per cell and state
+static std::deque<uint64_t> pending[IK_RESOLUTION_Y][IK_RESOLUTION_X][2];
+static std::vector<uint32_t> latencies;
+static uint32_t generated;
+static uint32_t in_reports;
+
+static uint32_t rand_next(void) {
+  static uint32_t x = 2463534242u;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+static void dev_schedule_event(uint64_t time_us, uint8_t event, uint8_t a,
+                               uint8_t b) {
+  dev_event_t ev = {{event, a, b, 0, 0, 0, 0, 0}, time_us};
+  dev_schedule.insert({time_us, ev});
+}
+
+static void hid_out_cb(uint8_t daddr, uint8_t const *report, uint16_t len) {
+  (void)daddr;
+  (void)len;
+
+  switch (report[0]) {
+  case IK_CMD_INIT:
+    dev_mode = report[1];
+    break;
+
+  case IK_CMD_GET_EVENT:
+    dev_get_event = true;
+    break;
+
+  case IK_CMD_GET_VERSION:
+    dev_replies.push_back({{IK_EVENT_VERSION, 1, 0}, now_us});
+    break;
+
+  case IK_CMD_CORRECT: {
+    // current membrane, queued behind events that occurred before
+    for (uint8_t row = 0; row < IK_RESOLUTION_Y; row++) {
+      uint32_t pressed = dev_membrane[row];
+      while (pressed) {
+        uint8_t const col = (uint8_t)__builtin_ctz(pressed);
+        pressed &= pressed - 1;
+        dev_events.push_back({{IK_EVENT_CORRECT_MEMBRANE, col, row}, now_us});
+      }
+    }
+    dev_events.push_back({{IK_EVENT_CORRECT_DONE}, now_us});
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+void tuh_hid_report_sent_cb(uint8_t dev_addr, uint8_t idx,
+                            uint8_t const *report, uint16_t len) {
+  ik->hid_report_sent_cb(dev_addr, idx, report, len);
+}
+
+static void membrane_cb(uint8_t row, uint8_t col, uint8_t state) {
+  std::deque<uint64_t> *cell = &pending[row][col][state ? 1 : 0];
+  if (!cell->empty()) {
+    latencies.push_back((uint32_t)(now_us - cell->front()));
+    cell->pop_front();
+  }
+}
+
+// Typing: presses held 40-120 ms on free cells, and sensor noise
+static void schedule_input(uint64_t start_us, uint32_t seconds, uint32_t kps,
+                           uint32_t sps) {
+  uint64_t const end_us = start_us + (uint64_t)seconds * 1000000;
+  uint32_t busy_until[IK_RESOLUTION_Y][IK_RESOLUTION_X] = {{0}};
+
+  for (uint32_t i = 0; kps && i < seconds * kps; i++) {
+    uint64_t const press_us = start_us + rand_next() % (end_us - start_us);
+    uint64_t const release_us = press_us + 40000 + rand_next() % 80000;
+    uint8_t const row = (uint8_t)(rand_next() % IK_RESOLUTION_Y);
+    uint8_t const col = (uint8_t)(rand_next() % IK_RESOLUTION_X);
+
+    // keep the same cell apart so that press and release pair up
+    uint32_t const press_ms = (uint32_t)((press_us - start_us) / 1000);
+    if (press_ms < busy_until[row][col] + 20) {
+      continue;
+    }
+    busy_until[row][col] = (uint32_t)((release_us - start_us) / 1000);
+
+    dev_schedule_event(press_us, IK_EVENT_MEMBRANE_PRESS, col, row);
+    dev_schedule_event(release_us, IK_EVENT_MEMBRANE_RELEASE, col, row);
+  }
+
+  for (uint32_t i = 0; sps && i < seconds * sps; i++) {
+    uint64_t const time_us = start_us + rand_next() % (end_us - start_us);
+    dev_schedule_event(time_us, IK_EVENT_SENSOR_CHANGE, (uint8_t)(i % 3),
+                       (uint8_t)(100 + rand_next() % 4));
+  }
+}
+
+// events that occurred by now go to the device queue
+static void dev_occur(void) {
+  while (!dev_schedule.empty() && dev_schedule.begin()->first <= now_us) {
+    dev_event_t ev = dev_schedule.begin()->second;
+    dev_schedule.erase(dev_schedule.begin());
+
+    uint8_t const col = ev.report[1];
+    uint8_t const row = ev.report[2];
+    if (ev.report[0] == IK_EVENT_MEMBRANE_PRESS) {
+      dev_membrane[row] |= 1ul << col;
+      pending[row][col][1].push_back(ev.time_us);
+      generated++;
+    } else if (ev.report[0] == IK_EVENT_MEMBRANE_RELEASE) {
+      dev_membrane[row] &= ~(1ul << col);
+      pending[row][col][0].push_back(ev.time_us);
+      generated++;
+    }
+
+    dev_events.push_back(ev);
+  }
+}
+
+// one interrupt IN report per frame
+static void dev_in_report(void) {
+  dev_event_t ev;
+
+  if (!dev_replies.empty()) {
+    ev = dev_replies.front();
+    dev_replies.pop_front();
+  } else if (dev_mode == IK_EVENT_MODE_POLLED) {
+    if (!dev_get_event) {
+      return;
+    }
+    dev_get_event = false;
+
+    if (dev_events.empty()) {
+      ev = {{IK_EVENT_NOMOREEVENTS}, now_us};
+    } else {
+      ev = dev_events.front();
+      dev_events.pop_front();
+    }
+  } else {
+    if (dev_events.empty()) {
+      return;
+    }
+    ev = dev_events.front();
+    dev_events.pop_front();
+  }
+
+  in_reports++;
+  ik->hid_reprot_received_cb(DADDR, 0, ev.report, IK_REPORT_LEN);
+}
+
+typedef struct {
+  double cpu_us;      // per second of virtual time
+  double in_per_sec;  // interrupt IN reports
+  double out_per_sec; // OUT reports
+  double lat_avg_ms;
+  double lat_p99_ms;
+  double lat_max_ms;
+  uint32_t lost;
+} result_t;
+
+static result_t run(uint8_t mode, uint16_t interval, uint32_t seconds,
+                    uint32_t kps, uint32_t sps) {
+  ik = new Adafruit_IntelliKeys();
+  ik->begin();
+  ik->setEventMode(mode, interval);
+  ik->onMemBraneChanged(membrane_cb);
+
+  dev_schedule.clear();
+  dev_events.clear();
+  dev_replies.clear();
+  dev_get_event = false;
+  dev_mode = IK_EVENT_MODE_AUTO;
+  memset(dev_membrane, 0, sizeof(dev_membrane));
+  for (auto &row : pending) {
+    for (auto &cell : row) {
+      cell[0].clear();
+      cell[1].clear();
+    }
+  }
+  latencies.clear();
+  generated = 0;
+  in_reports = 0;
+
+  host_device_set(DADDR, IK_VID, IK_PID_RUNNING);
+  ik->mount(DADDR);
+
+  // switch on, then let startup commands drain before measuring
+  dev_schedule_event(now_us, IK_EVENT_ONOFFSWITCH, 1, 0);
+  uint64_t const start_us = now_us + 500000;
+  schedule_input(start_us, seconds, kps, sps);
+
+  uint64_t const end_us = start_us + (uint64_t)seconds * 1000000 + 500000;
+  uint32_t in_start = 0, out_start = 0;
+  double cpu_ns = 0;
+
+  // past the end, keep going while the device still holds events (bus
+  // saturated), up to 10 s
+  while (now_us < end_us ||
+         (!dev_events.empty() && now_us < end_us + 10000000)) {
+    host_micros_advance(1000);
+    now_us += 1000;
+    dev_occur();
+
+    if (now_us == start_us) {
+      in_start = in_reports;
+      out_start = host_usb_stats()->hid_out;
+      cpu_ns = 0;
+    }
+
+    bench_clock::time_point const t0 = bench_clock::now();
+    tuh_task();
+    dev_in_report();
+    ik->Periodic();
+    cpu_ns += (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  bench_clock::now() - t0)
+                  .count();
+  }
+
+  double const span_s = (double)(now_us - start_us) / 1e6;
+  result_t result;
+  result.cpu_us = cpu_ns / 1000 / span_s;
+  result.in_per_sec = (in_reports - in_start) / span_s;
+  result.out_per_sec = (host_usb_stats()->hid_out - out_start) / span_s;
+  result.lost = generated - (uint32_t)latencies.size();
+
+  std::sort(latencies.begin(), latencies.end());
+  double sum = 0;
+  for (uint32_t lat : latencies) {
+    sum += lat;
+  }
+  size_t const count = latencies.size();
+  result.lat_avg_ms = count ? sum / count / 1000 : 0;
+  result.lat_p99_ms = count ? latencies[count * 99 / 100] / 1000.0 : 0;
+  result.lat_max_ms = count ? latencies[count - 1] / 1000.0 : 0;
+
+  if (mode == IK_EVENT_MODE_POLLED) {
+    ik_event_stats_t const *stats = ik->getEventStats();
+    printf("polled %2u ms: %u polls, %u batches, max batch %u, %u timeouts\n",
+           interval, stats->polls, stats->batches, stats->max_batch,
+           stats->timeouts);
+  }
+
+  ik->umount(DADDR);
+  host_device_set(DADDR, 0, 0);
+  delete ik;
+  ik = NULL;
+
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t seconds = 60;
+  uint32_t kps = 20;
+  uint32_t sps = 100;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:k:s:")) != -1) {
+    switch (opt) {
+    case 't':
+      seconds = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+
+    case 'k':
+      kps = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+
+    case 's':
+      sps = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+
+    default:
+      printf("usage: %s [-t seconds] [-k keys/s] [-s sensor events/s]\n",
+             argv[0]);
+      return 2;
+    }
+  }
+
+  host_set_hid_out_cb(hid_out_cb);
+
+  struct {
+    uint8_t mode;
+    uint16_t interval;
+  } const modes[] = {{IK_EVENT_MODE_AUTO, 0},
+                     {IK_EVENT_MODE_POLLED, 4},
+                     {IK_EVENT_MODE_POLLED, 8},
+                     {IK_EVENT_MODE_POLLED, 16}};
+
+  result_t results[sizeof(modes) / sizeof(modes[0])];
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    results[i] = run(modes[i].mode, modes[i].interval, seconds, kps, sps);
+  }
+
+  printf("%u s, %u keys/s, %u sensor events/s\n", seconds, kps, sps);
+  printf("mode          CPU us/s   IN/s  OUT/s  latency ms avg / p99 / max  "
+         "lost\n");
+
+  uint32_t lost = 0;
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    result_t const *r = &results[i];
+    if (modes[i].mode == IK_EVENT_MODE_AUTO) {
+      printf("auto        ");
+    } else {
+      printf("polled %2u ms", modes[i].interval);
+    }
+    printf("  %8.1f  %5.0f  %5.0f  %10.2f / %5.2f / %5.2f  %4u\n", r->cpu_us,
+           r->in_per_sec, r->out_per_sec, r->lat_avg_ms, r->lat_p99_ms,
+           r->lat_max_ms, r->lost);
+    lost += r->lost;
+  }
+
+  return lost ? 1 : 0;
+}
@@ -0,0 +1,740 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Drive the translation hot path ProcessInput() -> InterpretRaw() ->
+// getHIDReport() on a Linux host and time it.
+//
+// usage: ik_host_bench [iterations]
+
+#include <chrono>
+
+#include "Adafruit_IntelliKeys.h"
+#include "IKDeviceManager.h"
+#include "host_shim.h"
+
+#define DADDR 1
+
+typedef std::chrono::steady_clock bench_clock;
+
+// second and third device, served by the device manager
+#define MULTI_DADDR1 2
+#define MULTI_DADDR2 3
+#define MULTI_DADDR3 4
+#define MULTI_DADDR4 5
+
+static Adafruit_IntelliKeys IKeys;
+static IKDeviceManager IKManager;
+
+void tuh_hid_report_sent_cb(uint8_t dev_addr, uint8_t idx,
+                            uint8_t const *report, uint16_t len) {
+  if (dev_addr == DADDR) {
+    IKeys.hid_report_sent_cb(dev_addr, idx, report, len);
+  } else {
+    IKManager.hid_report_sent_cb(dev_addr, idx, report, len);
+  }
+}
+
+static void send_event(uint8_t event, uint8_t a = 0, uint8_t b = 0) {
+  uint8_t report[IK_REPORT_LEN] = {event, a, b, 0, 0, 0, 0, 0};
+  IKeys.hid_reprot_received_cb(DADDR, 0, report, IK_REPORT_LEN);
+  IKeys.ProcessInputQueue(); // decode now instead of on next Periodic()
+}
+
+static void send_multi_event(uint8_t daddr, uint8_t event, uint8_t a = 0,
+                             uint8_t b = 0) {
+  uint8_t report[IK_REPORT_LEN] = {event, a, b, 0, 0, 0, 0, 0};
+  IKManager.hid_reprot_received_cb(daddr, 0, report, IK_REPORT_LEN);
+  IKManager.getDevice(daddr)->ProcessInputQueue();
+}
+
+// membrane event use (x = col, y = row)
+static void press(uint8_t row, uint8_t col) {
+  send_event(IK_EVENT_MEMBRANE_PRESS, col, row);
+}
+
+static void release(uint8_t row, uint8_t col) {
+  send_event(IK_EVENT_MEMBRANE_RELEASE, col, row);
+}
+
+static uint8_t last_out[IK_REPORT_LEN];
+
+static void hid_out_cb(uint8_t daddr, uint8_t const *report, uint16_t len) {
+  (void)daddr;
+  memcpy(last_out, report, len < IK_REPORT_LEN ? len : IK_REPORT_LEN);
+}
+
+static void run_periodic(uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    host_millis_advance(8);
+    tuh_task();
+    IKeys.Periodic();
+  }
+}
+
+static double elapsed_ns(bench_clock::time_point start, uint32_t count) {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      bench_clock::now() - start);
+  return (double)ns.count() / count;
+}
+
+// Reports are consumed in order, skip to the latest one
+static uint32_t latest_report(hid_keyboard_report_t *kb_report,
+                              hid_mouse_report_t *mouse_report) {
+  uint32_t seq = IKeys.getHIDReport(kb_report, mouse_report);
+  while (1) {
+    uint32_t const next = IKeys.getHIDReport(kb_report, mouse_report);
+    if (next == seq) {
+      return seq;
+    }
+    seq = next;
+  }
+}
+
+// Attach device, switch it on and settle on the QWERTY overlay
+static bool setup_device(void) {
+  IKeys.begin();
+
+  host_device_set(DADDR, IK_VID, IK_PID_RUNNING);
+  if (!IKeys.mount(DADDR)) {
+    printf("mount failed\n");
+    return false;
+  }
+
+  send_event(IK_EVENT_ONOFFSWITCH, 1);
+
+  // overlay number is bit-coded by 3 sensors: QWERTY (5) = 0b101
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 200);
+  send_event(IK_EVENT_SENSOR_CHANGE, 1, 50);
+  send_event(IK_EVENT_SENSOR_CHANGE, 2, 200);
+
+  run_periodic(200);
+
+  if (IKeys.GetCurrentOverlayNumber() != IK_OVERLAY_QWERTY) {
+    printf("overlay not recognized: %d\n", IKeys.GetCurrentOverlayNumber());
+    return false;
+  }
+
+  return true;
+}
+
+// Q is the first key of the 4th row (row 9, col 0) of QWERTY overlay
+static bool check_translation(void) {
+  hid_keyboard_report_t kb_report;
+  hid_mouse_report_t mouse_report;
+
+  uint32_t const seq = latest_report(&kb_report, &mouse_report);
+
+  press(9, 0);
+  if (IKeys.getHIDReportSeq() != seq) {
+    printf("press: report seq changed before the report is consumed\n");
+    return false;
+  }
+  uint32_t const press_seq = latest_report(&kb_report, &mouse_report);
+  if (kb_report.keycode[0] != HID_KEY_Q || press_seq == seq ||
+      IKeys.getHIDReportSeq() != press_seq) {
+    printf("press: expected keycode %02x, got %02x\n", HID_KEY_Q,
+           kb_report.keycode[0]);
+    return false;
+  }
+
+  // another cell of the same key: report is unchanged
+  press(10, 1);
+  if (latest_report(&kb_report, &mouse_report) != press_seq) {
+    printf("press: report changed by another cell of the same key\n");
+    return false;
+  }
+
+  release(9, 0);
+  release(10, 1);
+  if (latest_report(&kb_report, &mouse_report) == press_seq ||
+      kb_report.keycode[0] != 0) {
+    printf("release: expected no keycode, got %02x\n", kb_report.keycode[0]);
+    return false;
+  }
+
+  // latch shift (row 18, col 2) then type Q: shift is lifted after Q.
+  // Modifier ignores changes within 5 ms of the last one
+  host_millis_advance(8);
+  press(18, 2);
+  release(18, 2);
+  press(9, 0);
+
+  // in order: shift, shift + Q, then Q alone once shift is lifted
+  for (uint8_t i = 0; i < IK_HID_EVENT_DEPTH; i++) {
+    IKeys.getHIDReport(&kb_report, &mouse_report);
+    if (kb_report.keycode[0] != 0) {
+      break;
+    }
+  }
+  if (kb_report.modifier != KEYBOARD_MODIFIER_LEFTSHIFT ||
+      kb_report.keycode[0] != HID_KEY_Q) {
+    printf("latch: expected shift + Q, got %02x + %02x\n", kb_report.modifier,
+           kb_report.keycode[0]);
+    return false;
+  }
+
+  IKeys.getHIDReport(&kb_report, &mouse_report);
+  release(9, 0);
+  if (kb_report.modifier != 0 || kb_report.keycode[0] != HID_KEY_Q) {
+    printf("latch: shift is not lifted\n");
+    return false;
+  }
+
+  return true;
+}
+
+// Report holds 6 keycodes: releasing a reported key while 7 are held brings
+// the 7th one in. Q W E R T Y U are every other column of row 9 of QWERTY
+static bool check_report_full(void) {
+  hid_keyboard_report_t kb_report;
+  hid_mouse_report_t mouse_report;
+
+  for (uint8_t i = 0; i < 7; i++) {
+    press(9, (uint8_t)(2 * i));
+  }
+  latest_report(&kb_report, &mouse_report);
+  if (kb_report.keycode[0] != HID_KEY_Q || kb_report.keycode[5] != HID_KEY_Y) {
+    printf("full: expected Q..Y, got %02x..%02x\n", kb_report.keycode[0],
+           kb_report.keycode[5]);
+    return false;
+  }
+
+  release(9, 0);
+  latest_report(&kb_report, &mouse_report);
+  if (kb_report.keycode[0] != HID_KEY_W || kb_report.keycode[5] != HID_KEY_U) {
+    printf("full: expected W..U, got %02x..%02x\n", kb_report.keycode[0],
+           kb_report.keycode[5]);
+    return false;
+  }
+
+  for (uint8_t i = 1; i < 7; i++) {
+    release(9, (uint8_t)(2 * i));
+  }
+  latest_report(&kb_report, &mouse_report);
+  return kb_report.keycode[0] == 0;
+}
+
+// key tone must not wait behind the on/off sweep sound
+static bool check_priority(void) {
+  send_event(IK_EVENT_ONOFFSWITCH, 0);
+  send_event(IK_EVENT_ONOFFSWITCH, 1);
+  press(9, 0);
+  release(9, 0);
+
+  tuh_task(); // complete in-flight report, chain the next one
+  IKeys.Periodic();
+
+  if (last_out[0] != IK_CMD_TONE || last_out[1] != 247) {
+    printf("priority: expected key tone, got %02x %02x\n", last_out[0],
+           last_out[1]);
+    return false;
+  }
+
+  run_periodic(1000); // drain sweep sound
+  return true;
+}
+
+// Receive callback only queues reports, decoded by the next Periodic()
+static void queue_event(uint8_t event, uint8_t a = 0, uint8_t b = 0) {
+  uint8_t report[IK_REPORT_LEN] = {event, a, b, 0, 0, 0, 0, 0};
+  IKeys.hid_reprot_received_cb(DADDR, 0, report, IK_REPORT_LEN);
+}
+
+// A correction burst that fits the input queue is not lost, one more report
+// than the queue holds is counted as overflow
+static bool check_input_queue(void) {
+  uint32_t membrane[IK_RESOLUTION_Y];
+
+  for (uint8_t row = 9; row < 12; row++) {
+    for (uint8_t col = 0; col < 10; col++) {
+      queue_event(IK_EVENT_CORRECT_MEMBRANE, col, row);
+    }
+  }
+  queue_event(IK_EVENT_CORRECT_DONE);
+
+  IKeys.getMembrane(membrane);
+  if (membrane[9] != 0) {
+    printf("input: decoded before Periodic()\n");
+    return false;
+  }
+
+  IKeys.Periodic();
+  IKeys.getMembrane(membrane);
+  if (membrane[9] != 0x3ff || membrane[10] != 0x3ff || membrane[11] != 0x3ff ||
+      IKeys.getInputOverflow() != 0) {
+    printf("input: correction lost, rows %03x %03x %03x, overflow %u\n",
+           membrane[9], membrane[10], membrane[11], IKeys.getInputOverflow());
+    return false;
+  }
+
+  for (uint8_t row = 9; row < 12; row++) {
+    for (uint8_t col = 0; col < 10; col++) {
+      queue_event(IK_EVENT_MEMBRANE_RELEASE, col, row);
+    }
+  }
+  IKeys.Periodic();
+
+  for (uint8_t i = 0; i < IK_INPUT_FIFO_SIZE + 1; i++) {
+    queue_event(IK_EVENT_NOMOREEVENTS);
+  }
+  IKeys.Periodic();
+
+  IKeys.getMembrane(membrane);
+  if (membrane[9] != 0 || IKeys.getInputOverflow() != 1) {
+    printf("input: expected overflow 1, got %u\n", IKeys.getInputOverflow());
+    return false;
+  }
+
+  run_periodic(100); // drain key sounds
+  return true;
+}
+
+// Two devices behind the manager: keys pressed on both are merged into one
+// report, and a device switched off or unplugged drops out of it
+static bool check_multi_device(void) {
+  uint8_t const daddrs[] = {MULTI_DADDR1, MULTI_DADDR2};
+
+  IKManager.begin();
+
+  for (uint8_t daddr : daddrs) {
+    host_device_set(daddr, IK_VID, IK_PID_RUNNING);
+    if (!IKManager.mount(daddr)) {
+      printf("multi: mount %u failed\n", daddr);
+      return false;
+    }
+
+    send_multi_event(daddr, IK_EVENT_ONOFFSWITCH, 1);
+    send_multi_event(daddr, IK_EVENT_SENSOR_CHANGE, 0, 200);
+    send_multi_event(daddr, IK_EVENT_SENSOR_CHANGE, 1, 50);
+    send_multi_event(daddr, IK_EVENT_SENSOR_CHANGE, 2, 200);
+  }
+
+  if (IKManager.getDeviceCount() != 2) {
+    printf("multi: expected 2 devices, got %u\n", IKManager.getDeviceCount());
+    return false;
+  }
+
+  for (uint32_t i = 0; i < 200; i++) {
+    host_millis_advance(8);
+    tuh_task();
+    IKManager.Periodic();
+  }
+
+  // consume reports queued while settling
+  hid_keyboard_report_t kb_report;
+  hid_mouse_report_t mouse_report;
+  for (uint8_t i = 0; i < IK_HID_EVENT_DEPTH; i++) {
+    IKManager.getHIDReport(&kb_report, &mouse_report);
+  }
+
+  // Q (row 9, col 0) on the first device, W (row 9, col 2) on the second
+  send_multi_event(MULTI_DADDR1, IK_EVENT_MEMBRANE_PRESS, 0, 9);
+  send_multi_event(MULTI_DADDR2, IK_EVENT_MEMBRANE_PRESS, 2, 9);
+  uint32_t const seq = IKManager.getHIDReport(&kb_report, &mouse_report);
+  if (kb_report.keycode[0] != HID_KEY_Q || kb_report.keycode[1] != HID_KEY_W) {
+    printf("multi: expected keycodes %02x %02x, got %02x %02x\n", HID_KEY_Q,
+           HID_KEY_W, kb_report.keycode[0], kb_report.keycode[1]);
+    return false;
+  }
+
+  // unplug the first device: only W is left
+  IKManager.umount(MULTI_DADDR1);
+  host_device_set(MULTI_DADDR1, 0, 0);
+  if (IKManager.getHIDReport(&kb_report, &mouse_report) == seq ||
+      kb_report.keycode[0] != HID_KEY_W || kb_report.keycode[1] != 0) {
+    printf("multi: expected keycode %02x after unplug, got %02x %02x\n",
+           HID_KEY_W, kb_report.keycode[0], kb_report.keycode[1]);
+    return false;
+  }
+
+  send_multi_event(MULTI_DADDR2, IK_EVENT_MEMBRANE_RELEASE, 2, 9);
+  IKManager.umount(MULTI_DADDR2);
+  host_device_set(MULTI_DADDR2, 0, 0);
+
+  return !IKManager.isAttached();
+}
+
+// Changes of several devices within one poll must not cancel out in the
+// merged sequence: the second device holding W is unplugged while the first
+// one presses Q. Devices are served by unused slots so that their report
+// sequences are small (1 and 2), which a sum of sequences would not notice.
+static bool check_multi_seq(void) {
+  uint8_t const idle[] = {MULTI_DADDR3, MULTI_DADDR4};
+  uint8_t const daddrs[] = {MULTI_DADDR1, MULTI_DADDR2};
+  hid_keyboard_report_t kb_report;
+  hid_mouse_report_t mouse_report;
+
+  // occupy slots used by check_multi_device(), switched off
+  for (uint8_t daddr : idle) {
+    host_device_set(daddr, IK_VID, IK_PID_RUNNING);
+    IKManager.mount(daddr);
+  }
+
+  for (uint8_t daddr : daddrs) {
+    host_device_set(daddr, IK_VID, IK_PID_RUNNING);
+    IKManager.mount(daddr);
+    send_multi_event(daddr, IK_EVENT_ONOFFSWITCH, 1);
+    send_multi_event(daddr, IK_EVENT_SENSOR_CHANGE, 0, 200);
+    send_multi_event(daddr, IK_EVENT_SENSOR_CHANGE, 1, 50);
+    send_multi_event(daddr, IK_EVENT_SENSOR_CHANGE, 2, 200);
+  }
+  for (uint32_t i = 0; i < 200; i++) {
+    host_millis_advance(8);
+    tuh_task();
+    IKManager.Periodic();
+  }
+  for (uint8_t i = 0; i < IK_HID_EVENT_DEPTH; i++) {
+    IKManager.getHIDReport(&kb_report, &mouse_report);
+  }
+
+  send_multi_event(MULTI_DADDR2, IK_EVENT_MEMBRANE_PRESS, 2, 9);
+  uint32_t const seq = IKManager.getHIDReport(&kb_report, &mouse_report);
+  if (kb_report.keycode[0] != HID_KEY_W) {
+    printf("multi seq: expected keycode %02x, got %02x\n", HID_KEY_W,
+           kb_report.keycode[0]);
+    return false;
+  }
+
+  send_multi_event(MULTI_DADDR1, IK_EVENT_MEMBRANE_PRESS, 0, 9);
+  IKManager.umount(MULTI_DADDR2);
+  host_device_set(MULTI_DADDR2, 0, 0);
+  uint32_t const next = IKManager.getHIDReport(&kb_report, &mouse_report);
+  if (next == seq || kb_report.keycode[0] != HID_KEY_Q ||
+      kb_report.keycode[1] != 0) {
+    printf("multi seq: report %02x %02x not signaled (seq %u -> %u)\n",
+           kb_report.keycode[0], kb_report.keycode[1], seq, next);
+    return false;
+  }
+
+  send_multi_event(MULTI_DADDR1, IK_EVENT_MEMBRANE_RELEASE, 0, 9);
+  uint8_t const remaining[] = {MULTI_DADDR1, MULTI_DADDR3, MULTI_DADDR4};
+  for (uint8_t daddr : remaining) {
+    IKManager.umount(daddr);
+    host_device_set(daddr, 0, 0);
+  }
+
+  return !IKManager.isAttached();
+}
+
+// Run Periodic() every 1 ms like loop1() until overlay settles on expected
+// one (-1 for none), return elapsed ms or 0 if it did not within max_ms
+static uint32_t wait_overlay(int overlay, uint32_t max_ms) {
+  for (uint32_t ms = 1; ms <= max_ms; ms++) {
+    host_millis_advance(1);
+    tuh_task();
+    IKeys.Periodic();
+    if (IKeys.GetCurrentOverlayNumber() == overlay) {
+      return ms;
+    }
+  }
+  return 0;
+}
+
+// Overlay is confirmed by stable samples well before the settle timeout, a
+// one-sample spike on a sensor is rejected by the median filter and sensor
+// noise between two samples is decimated. A sensor sitting within its
+// hysteresis band falls back to the timeout.
+static bool check_sensor_filter(void) {
+  ik_sensor_stats_t const before = *IKeys.getSensorStats(0);
+  ik_overlay_stats_t const overlay_before = *IKeys.getOverlayStats();
+
+  // QWERTY (0b101) -> MOUSE ACCESS (0b100), after a burst of noise of which
+  // only the last value is sampled
+  for (uint8_t i = 0; i < 10; i++) {
+    send_event(IK_EVENT_SENSOR_CHANGE, 0, (uint8_t)(100 + i * 10));
+  }
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 50);
+  wait_overlay(-1, 5 * IK_SENSOR_PERIOD);
+
+  // spike held for a single sample, while counting stable samples
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 200);
+  wait_overlay(-1, IK_SENSOR_PERIOD);
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 50);
+
+  // time since sensor change, median adds one sample
+  uint32_t const elapsed =
+      6 * IK_SENSOR_PERIOD +
+      wait_overlay(IK_OVERLAY_MOUSE_ACCESS, IK_OVERLAY_SETTLE_TIMEOUT);
+  if (IKeys.GetCurrentOverlayNumber() != IK_OVERLAY_MOUSE_ACCESS ||
+      elapsed > (IK_OVERLAY_STABLE_COUNT + 2) * IK_SENSOR_PERIOD) {
+    printf("sensor: overlay %d not confirmed in time (%u ms)\n",
+           IKeys.GetCurrentOverlayNumber(), elapsed);
+    return false;
+  }
+
+  ik_sensor_stats_t const *stats = IKeys.getSensorStats(0);
+  if (stats->samples - before.samples != 13 ||
+      stats->decimated - before.decimated != 10) {
+    printf("sensor: expected 13 samples 10 decimated, got %u %u\n",
+           stats->samples - before.samples,
+           stats->decimated - before.decimated);
+    return false;
+  }
+
+  // back to QWERTY with sensor 0 settling within the hysteresis band, taken
+  // once the confident value has refined the threshold
+  uint8_t const band = IKeys.getSensorThreshold(0) + IK_SENSOR_HYSTERESIS;
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, band + 4);
+  wait_overlay(-1, (IK_SENSOR_WINDOW + 1) * IK_SENSOR_PERIOD);
+  send_event(IK_EVENT_SENSOR_CHANGE, 0,
+             IKeys.getSensorThreshold(0) + IK_SENSOR_HYSTERESIS / 2);
+  if (!wait_overlay(IK_OVERLAY_QWERTY, IK_OVERLAY_SETTLE_TIMEOUT + 50)) {
+    printf("sensor: overlay %d not settled by timeout\n",
+           IKeys.GetCurrentOverlayNumber());
+    return false;
+  }
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 200);
+
+  ik_overlay_stats_t const *overlay_stats = IKeys.getOverlayStats();
+  if (overlay_stats->confirmed - overlay_before.confirmed != 1 ||
+      overlay_stats->timeouts - overlay_before.timeouts != 1 ||
+      overlay_stats->last_ms < IK_OVERLAY_SETTLE_TIMEOUT) {
+    printf("sensor: expected 1 confirmed 1 timeout, got %u %u\n",
+           overlay_stats->confirmed - overlay_before.confirmed,
+           overlay_stats->timeouts - overlay_before.timeouts);
+    return false;
+  }
+
+  return IKeys.getSensorStats(IK_NUM_SENSORS) == NULL;
+}
+
+// Custom overlay built at runtime: a full report table is reported instead of
+// silently mapping cells to no report, out of range cells read as no report
+static bool check_overlay_table(void) {
+  static IKOverlay overlay;
+  ik_report_t report = {.type = IK_REPORT_TYPE_KEYBOARD, .keyboard = {0, 0}};
+
+  for (int i = 1; i <= IK_OVERLAY_MAX_REPORTS; i++) {
+    report.keyboard.keycode = (uint8_t)i;
+    bool const added = overlay.setMembraneReport(
+        i / IK_RESOLUTION_X, i % IK_RESOLUTION_X, 1, 1, &report);
+    if (added != (i < IK_OVERLAY_MAX_REPORTS)) {
+      printf("overlay: report %d added %d\n", i, added);
+      return false;
+    }
+  }
+
+  report.type = IK_REPORT_TYPE_MOUSE;
+  overlay.getMembraneReport(IK_RESOLUTION_Y, 0, &report);
+  if (report.type != IK_REPORT_TYPE_NONE) {
+    printf("overlay: out of range cell gives report type %u\n", report.type);
+    return false;
+  }
+
+  return true;
+}
+
+// Before the first confident value the bit follows the plain threshold, the
+// hysteresis band only holds a bit that was decided
+static bool check_sensor_first_bit(void) {
+  IKSensor sensor;
+  // within the band sets the bit, clear of it confirms, back within holds it
+  uint8_t const values[] = {160, 200, 140};
+
+  sensor.Reset(150);
+  for (uint8_t i = 0; i < sizeof(values); i++) {
+    sensor.OnChange(values[i]);
+    for (uint8_t n = 0; n < IK_SENSOR_WINDOW; n++) {
+      sensor.Sample();
+    }
+    if (!sensor.IsSet()) {
+      printf("sensor: value %u gives bit %d\n", values[i], sensor.IsSet());
+      return false;
+    }
+  }
+
+  sensor.Reset(150);
+  sensor.OnChange(140);
+  for (uint8_t n = 0; n < IK_SENSOR_WINDOW; n++) {
+    sensor.Sample();
+  }
+  if (sensor.IsSet() || sensor.IsConfident()) {
+    printf("sensor: first value 140 gives bit %d\n", sensor.IsSet());
+    return false;
+  }
+
+  return true;
+}
+
+// Device replies to IK_CMD_EEPROM_READBYTE, one event per byte
+static void send_eeprom(char const *serial, uint8_t black, uint8_t white) {
+  eeprom_t eeprom;
+  memset(&eeprom, 0, sizeof(eeprom));
+  strncpy((char *)eeprom.serialnumber, serial, IK_EEPROM_SN_SIZE);
+  memset(eeprom.sensorBlack, black, IK_NUM_SENSORS);
+  memset(eeprom.sensorWhite, white, IK_NUM_SENSORS);
+
+  uint8_t const *bytes = (uint8_t const *)&eeprom;
+  for (uint8_t i = 0; i < sizeof(eeprom_t); i++) {
+    send_event(IK_EVENT_EEPROM_READBYTE, bytes[i], (uint8_t)(0x80 + i));
+  }
+}
+
+// Threshold follows a sensor whose white level drifts down past the factory
+// hysteresis band, and is restored by serial number on reconnect before the
+// EEPROM is read again
+static bool check_sensor_calibration(void) {
+  send_eeprom("C-BENCH1", 50, 200);
+  int const factory = IKeys.getSensorThreshold(0);
+  if (factory != 125) {
+    printf("calibration: expected factory threshold 125, got %d\n", factory);
+    return false;
+  }
+
+  // sensor 0 of QWERTY (0b101) drifts from 200 down to 130
+  for (uint8_t value = 195; value >= 130; value -= 5) {
+    send_event(IK_EVENT_SENSOR_CHANGE, 0, value);
+    wait_overlay(-1, 3 * IK_SENSOR_PERIOD);
+  }
+  int const refined = IKeys.getSensorThreshold(0);
+  if (IKeys.GetCurrentOverlayNumber() != IK_OVERLAY_QWERTY ||
+      refined + IK_SENSOR_HYSTERESIS >= 130) {
+    printf("calibration: threshold %d did not follow drift\n", refined);
+    return false;
+  }
+
+  // swap to MOUSE ACCESS (0b100) and back, confirmed without timeout
+  uint32_t const limit = (IK_OVERLAY_STABLE_COUNT + 3) * IK_SENSOR_PERIOD;
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 50);
+  if (!wait_overlay(IK_OVERLAY_MOUSE_ACCESS, limit)) {
+    printf("calibration: overlay %d, expected %d\n",
+           IKeys.GetCurrentOverlayNumber(), IK_OVERLAY_MOUSE_ACCESS);
+    return false;
+  }
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 130);
+  if (!wait_overlay(IK_OVERLAY_QWERTY, limit)) {
+    printf("calibration: overlay %d, expected %d\n",
+           IKeys.GetCurrentOverlayNumber(), IK_OVERLAY_QWERTY);
+    return false;
+  }
+
+  // plug back: recognized with the refined threshold before the EEPROM
+  int const saved = IKeys.getSensorThreshold(0);
+  IKeys.umount(DADDR);
+  if (!IKeys.mount(DADDR) || IKeys.getSensorThreshold(0) != saved) {
+    printf("calibration: threshold %d not restored, got %d\n", saved,
+           IKeys.getSensorThreshold(0));
+    return false;
+  }
+
+  send_event(IK_EVENT_ONOFFSWITCH, 1);
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 130);
+  send_event(IK_EVENT_SENSOR_CHANGE, 1, 50);
+  send_event(IK_EVENT_SENSOR_CHANGE, 2, 200);
+  if (!wait_overlay(IK_OVERLAY_QWERTY, limit)) {
+    printf("calibration: overlay %d after reconnect, expected %d\n",
+           IKeys.GetCurrentOverlayNumber(), IK_OVERLAY_QWERTY);
+    return false;
+  }
+
+  // same serial number: saved calibration is kept over factory one
+  send_eeprom("C-BENCH1", 50, 200);
+  if (IKeys.getSensorThreshold(0) != saved) {
+    printf("calibration: threshold %d replaced by %d\n", saved,
+           IKeys.getSensorThreshold(0));
+    return false;
+  }
+
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 200);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t iterations = 100000;
+  if (argc > 1) {
+    iterations = (uint32_t)strtoul(argv[1], NULL, 0);
+  }
+
+  host_set_hid_out_cb(hid_out_cb);
+
+  if (!setup_device() || !check_translation() || !check_report_full() ||
+      !check_priority() || !check_input_queue() || !check_multi_device() ||
+      !check_multi_seq() || !check_overlay_table() ||
+      !check_sensor_filter() || !check_sensor_first_bit() ||
+      !check_sensor_calibration()) {
+    return 1;
+  }
+
+  hid_keyboard_report_t kb_report;
+  hid_mouse_report_t mouse_report;
+
+  //------------- idle scan -------------//
+  bench_clock::time_point start = bench_clock::now();
+  for (uint32_t i = 0; i < iterations; i++) {
+    IKeys.getHIDReport(&kb_report, &mouse_report);
+  }
+  double const idle_ns = elapsed_ns(start, iterations);
+
+  //------------- press/release, report and periodic -------------//
+  double input_ns = 0;
+  double report_ns = 0;
+  double periodic_ns = 0;
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    // walk through QWERTY letter rows: 3 rows x 2 cols per key
+    uint8_t const row = (uint8_t)(9 + (i % 3) * 3);
+    uint8_t const col = (uint8_t)((i / 3) % 9) * 2;
+
+    start = bench_clock::now();
+    press(row, col);
+    input_ns += elapsed_ns(start, 1);
+
+    start = bench_clock::now();
+    IKeys.getHIDReport(&kb_report, &mouse_report);
+    report_ns += elapsed_ns(start, 1);
+
+    start = bench_clock::now();
+    release(row, col);
+    input_ns += elapsed_ns(start, 1);
+
+    IKeys.getHIDReport(&kb_report, &mouse_report); // consume release
+
+    host_millis_advance(8);
+
+    start = bench_clock::now();
+    tuh_task();
+    IKeys.Periodic();
+    periodic_ns += elapsed_ns(start, 1);
+  }
+
+  //------------- sensor noise -------------//
+  start = bench_clock::now();
+  for (uint32_t i = 0; i < iterations; i++) {
+    send_event(IK_EVENT_SENSOR_CHANGE, 0, (uint8_t)(200 + (i & 1)));
+  }
+  double const sensor_ns = elapsed_ns(start, iterations);
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 200);
+
+  host_usb_stats_t const *stats = host_usb_stats();
+
+  printf("iterations          : %u\n", iterations);
+  printf("getHIDReport (idle) : %8.1f ns\n", idle_ns);
+  printf("getHIDReport (key)  : %8.1f ns\n", report_ns / iterations);
+  printf("ProcessInput        : %8.1f ns\n", input_ns / (2.0 * iterations));
+  printf("Periodic            : %8.1f ns\n", periodic_ns / iterations);
+  printf("Sensor change       : %8.1f ns\n", sensor_ns);
+  printf("HID OUT reports     : %u\n", stats->hid_out);
+
+  return 0;
+}
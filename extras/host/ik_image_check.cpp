@@ -0,0 +1,104 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Check that the packed and compressed EZ-USB images generated at compile
+// time read back to the same 8051 memory as the original INTEL_HEX_RECORD
+// tables, and print their sizes.
+//
+// usage: ik_image_check
+
+#include "host_shim.h"
+#include "ik_ezusb_image.h"
+
+#include "ik_firmware.h"
+#include "ik_loader.h"
+
+static constexpr auto loader_plain = IK_EZUSB_IMAGE(ik_loader);
+static constexpr auto loader_lz = IK_EZUSB_LZ_IMAGE(ik_loader);
+static constexpr auto firmware_plain = IK_EZUSB_IMAGE(ik_firmware);
+static constexpr auto firmware_lz = IK_EZUSB_LZ_IMAGE(ik_firmware);
+
+typedef struct {
+  uint8_t data[0x10000];
+  bool written[0x10000];
+} memory_t;
+
+static void apply_hex(memory_t *mem, INTEL_HEX_RECORD const *record) {
+  for (; record->Type == 0; record++) {
+    memcpy(mem->data + record->Address, record->Data, record->Length);
+    memset(mem->written + record->Address, 1, record->Length);
+  }
+}
+
+// same chunking as the download
+static void apply_image(memory_t *mem, uint8_t const *image, bool compressed) {
+  ik_ezusb_run_t run;
+
+  while (ik_ezusb_next_run(&image, &run, compressed)) {
+    for (uint16_t offset = 0; offset < run.len; offset += IK_EZUSB_MAX_XFER) {
+      uint16_t const len = tu_min16(run.len - offset, IK_EZUSB_MAX_XFER);
+      uint8_t const *data = run.data + offset;
+
+      uint8_t buf[IK_EZUSB_MAX_XFER];
+      if (compressed) {
+        ik_ezusb_lz_decode(&run.data, buf, len);
+        data = buf;
+      }
+
+      memcpy(mem->data + run.addr + offset, data, len);
+      memset(mem->written + run.addr + offset, 1, len);
+    }
+  }
+}
+
+static bool check(const char *name, INTEL_HEX_RECORD const *records,
+                  size_t records_size, uint8_t const *image, size_t image_size,
+                  bool compressed) {
+  static memory_t expected, actual;
+  memset(&expected, 0, sizeof(expected));
+  memset(&actual, 0, sizeof(actual));
+
+  apply_hex(&expected, records);
+  apply_image(&actual, image, compressed);
+
+  bool const ok = memcmp(&expected, &actual, sizeof(expected)) == 0;
+  printf("%-18s: %5zu -> %5zu bytes %s\n", name, records_size, image_size,
+         ok ? "ok" : "MISMATCH");
+  return ok;
+}
+
+int main(void) {
+  bool ok = true;
+
+  ok &= check("loader", ik_loader, sizeof(ik_loader), loader_plain.data,
+              sizeof(loader_plain), false);
+  ok &= check("loader (lz)", ik_loader, sizeof(ik_loader), loader_lz.data,
+              sizeof(loader_lz), true);
+  ok &= check("firmware", ik_firmware, sizeof(ik_firmware),
+              firmware_plain.data, sizeof(firmware_plain), false);
+  ok &= check("firmware (lz)", ik_firmware, sizeof(ik_firmware),
+              firmware_lz.data, sizeof(firmware_lz), true);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,368 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Replay a recorded USB capture through the driver: recorded interrupt IN
+// reports are fed to hid_reprot_received_cb() following the capture timeline
+// (virtual clock), and the OUT reports produced by ProcessCommands() are
+// checked against the recorded ones.
+//
+// The capture is a Total Phase Data Center CSV export (File -> Export, CSV).
+// The .tdc file is a compressed proprietary container and must be exported
+// with Data Center first. Columns are located by their header name:
+//   m:s.ms.us  timestamp
+//   Dev        device address
+//   Ep         endpoint, 0 (control) records are counted but not replayed
+//   Record     transaction record e.g "IN txn", "OUT txn"
+//   Data       payload as hex bytes
+//
+// usage: ik_replay [-r] [-s] [-w out.csv] capture.csv
+//   -r  replay with original timing (default is as fast as possible)
+//   -s  strict: exit with error if OUT reports differ from the capture
+//   -w  write the replayed session (recorded IN + produced OUT) as CSV, this
+//       can be used to create a new regression baseline
+//
+// The captures/*_golden.csv baselines are written by -w from the driver
+// itself, not recorded on hardware. They only detect changes in the produced
+// OUT reports and are regenerated when such a change is intended.
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Adafruit_IntelliKeys.h"
+#include "host_shim.h"
+
+#define DADDR 1
+
+typedef struct {
+  uint32_t time_us;
+  bool is_in;
+  uint8_t len;
+  uint8_t data[IK_REPORT_LEN];
+} ik_record_t;
+
+static Adafruit_IntelliKeys IKeys;
+static std::vector<ik_record_t> produced_out;
+static uint32_t now_us;
+
+static void hid_out_cb(uint8_t daddr, uint8_t const *report, uint16_t len) {
+  (void)daddr;
+  ik_record_t rec = {now_us, false, (uint8_t)len, {0}};
+  memcpy(rec.data, report, len < IK_REPORT_LEN ? len : IK_REPORT_LEN);
+  produced_out.push_back(rec);
+}
+
+void tuh_hid_report_sent_cb(uint8_t dev_addr, uint8_t idx,
+                            uint8_t const *report, uint16_t len) {
+  IKeys.hid_report_sent_cb(dev_addr, idx, report, len);
+}
+
+//--------------------------------------------------------------------+
+// Capture parser
+//--------------------------------------------------------------------+
+
+static std::vector<std::string> split_csv(std::string const &line) {
+  std::vector<std::string> fields;
+  std::string field;
+  bool quoted = false;
+
+  for (char ch : line) {
+    if (ch == '"') {
+      quoted = !quoted;
+    } else if (ch == ',' && !quoted) {
+      fields.push_back(field);
+      field.clear();
+    } else if (ch != '\r') {
+      field += ch;
+    }
+  }
+  fields.push_back(field);
+
+  return fields;
+}
+
+// "m:s.ms.us" e.g "1:02.345.678"
+static uint32_t parse_time_us(std::string const &str) {
+  unsigned min = 0, sec = 0, ms = 0, us = 0;
+  if (sscanf(str.c_str(), "%u:%u.%u.%u", &min, &sec, &ms, &us) != 4) {
+    return 0;
+  }
+  return ((min * 60 + sec) * 1000 + ms) * 1000 + us;
+}
+
+static int find_column(std::vector<std::string> const &header,
+                       char const *name) {
+  for (size_t i = 0; i < header.size(); i++) {
+    if (header[i] == name) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+static bool load_capture(char const *path, std::vector<ik_record_t> &records,
+                         uint32_t *control_count) {
+  std::ifstream file(path);
+  if (!file) {
+    printf("Failed to open %s\n", path);
+    return false;
+  }
+
+  std::string line;
+  std::vector<std::string> header;
+  int col_time = -1, col_ep = -1, col_record = -1, col_data = -1;
+
+  while (std::getline(file, line)) {
+    std::vector<std::string> fields = split_csv(line);
+
+    if (col_time < 0) {
+      col_time = find_column(fields, "m:s.ms.us");
+      col_ep = find_column(fields, "Ep");
+      col_record = find_column(fields, "Record");
+      col_data = find_column(fields, "Data");
+
+      if (col_time >= 0 && (col_ep < 0 || col_record < 0 || col_data < 0)) {
+        printf("Missing Ep/Record/Data column in capture header\n");
+        return false;
+      }
+      header = fields;
+      continue;
+    }
+
+    if (fields.size() < header.size()) {
+      continue;
+    }
+
+    unsigned ep = (unsigned)strtoul(fields[col_ep].c_str(), NULL, 16);
+    std::string const &record = fields[col_record];
+
+    if (ep == 0) {
+      if (record.find("Control") != std::string::npos) {
+        (*control_count)++;
+      }
+      continue;
+    }
+
+    bool is_in = (record.rfind("IN", 0) == 0);
+    if (!is_in && record.rfind("OUT", 0) != 0) {
+      continue;
+    }
+
+    ik_record_t rec = {parse_time_us(fields[col_time]), is_in, 0, {0}};
+    std::istringstream hex(fields[col_data]);
+    unsigned byte;
+    while (rec.len < IK_REPORT_LEN && (hex >> std::hex >> byte)) {
+      rec.data[rec.len++] = (uint8_t)byte;
+    }
+
+    if (rec.len == IK_REPORT_LEN) {
+      records.push_back(rec);
+    }
+  }
+
+  if (col_time < 0) {
+    printf("No Data Center CSV header found in %s\n", path);
+    return false;
+  }
+
+  return true;
+}
+
+static void write_record(FILE *fp, uint32_t index, ik_record_t const &rec) {
+  fprintf(fp, "%u,%u:%02u.%03u.%03u,%u,%s,", index,
+          rec.time_us / 60000000u, (rec.time_us / 1000000u) % 60,
+          (rec.time_us / 1000u) % 1000, rec.time_us % 1000,
+          rec.is_in ? 1 : 2, rec.is_in ? "IN txn" : "OUT txn");
+  for (uint8_t i = 0; i < rec.len; i++) {
+    fprintf(fp, "%s%02X", i ? " " : "", rec.data[i]);
+  }
+  fprintf(fp, "\n");
+}
+
+//--------------------------------------------------------------------+
+// Replay
+//--------------------------------------------------------------------+
+
+// Run USB host task and Periodic() every 1 ms of virtual time like loop1()
+static void advance_to(uint32_t time_us, bool realtime) {
+  while (now_us + 1000 <= time_us) {
+    now_us += 1000;
+    host_millis_set(now_us / 1000);
+    tuh_task();
+    IKeys.Periodic();
+
+    if (realtime) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  bool realtime = false;
+  bool strict = false;
+  char const *out_path = NULL;
+  char const *capture_path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-r")) {
+      realtime = true;
+    } else if (!strcmp(argv[i], "-s")) {
+      strict = true;
+    } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+      out_path = argv[++i];
+    } else {
+      capture_path = argv[i];
+    }
+  }
+
+  if (!capture_path) {
+    printf("usage: %s [-r] [-s] [-w out.csv] capture.csv\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<ik_record_t> records;
+  uint32_t control_count = 0;
+  if (!load_capture(capture_path, records, &control_count)) {
+    return 2;
+  }
+
+  std::vector<ik_record_t> recorded_out;
+  uint32_t in_count = 0;
+  for (ik_record_t const &rec : records) {
+    if (rec.is_in) {
+      in_count++;
+    } else {
+      recorded_out.push_back(rec);
+    }
+  }
+
+  if (in_count == 0) {
+    printf("No interrupt IN report found in capture\n");
+    return 2;
+  }
+
+  // driver starts at the first interrupt transfer i.e running firmware
+  uint32_t const base_us = records.front().time_us;
+
+  IKeys.begin();
+  host_set_hid_out_cb(hid_out_cb);
+  host_device_set(DADDR, IK_VID, IK_PID_RUNNING);
+  host_millis_set(0);
+  now_us = 0;
+
+  if (!IKeys.mount(DADDR)) {
+    printf("mount failed\n");
+    return 1;
+  }
+
+  auto const start = std::chrono::steady_clock::now();
+
+  for (ik_record_t &rec : records) {
+    rec.time_us -= base_us;
+    if (!rec.is_in) {
+      continue;
+    }
+
+    advance_to(rec.time_us, realtime);
+    IKeys.hid_reprot_received_cb(DADDR, 0, rec.data, rec.len);
+
+    // loop1() decodes it on the next Periodic() right after USBHost.task()
+    IKeys.Periodic();
+  }
+
+  // let pending commands drain
+  advance_to(now_us + 1000000, false);
+
+  auto const elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  //------------- compare OUT reports -------------//
+  size_t const common = std::min(recorded_out.size(), produced_out.size());
+  size_t matched = 0;
+  long first_mismatch = -1;
+
+  for (size_t i = 0; i < common; i++) {
+    if (0 == memcmp(recorded_out[i].data, produced_out[i].data,
+                    IK_REPORT_LEN)) {
+      matched++;
+    } else if (first_mismatch < 0) {
+      first_mismatch = (long)i;
+    }
+  }
+
+  bool const identical =
+      (matched == common) && (recorded_out.size() == produced_out.size());
+
+  printf("control transfers  : %u (not replayed)\n", control_count);
+  printf("IN reports         : %u\n", in_count);
+  printf("OUT recorded       : %zu\n", recorded_out.size());
+  printf("OUT produced       : %zu\n", produced_out.size());
+  printf("OUT matched        : %zu\n", matched);
+  if (first_mismatch >= 0) {
+    ik_record_t const &exp = recorded_out[first_mismatch];
+    ik_record_t const &got = produced_out[first_mismatch];
+    printf("first mismatch #%ld: expected", first_mismatch);
+    for (uint8_t i = 0; i < IK_REPORT_LEN; i++) {
+      printf(" %02X", exp.data[i]);
+    }
+    printf(", got");
+    for (uint8_t i = 0; i < IK_REPORT_LEN; i++) {
+      printf(" %02X", got.data[i]);
+    }
+    printf("\n");
+  }
+  printf("replay time        : %.3f ms (%.0f IN reports/s)\n",
+         elapsed.count() / 1000.0,
+         elapsed.count() ? in_count * 1e6 / elapsed.count() : 0.0);
+
+  if (out_path) {
+    FILE *fp = fopen(out_path, "w");
+    if (fp) {
+      fprintf(fp, "Index,m:s.ms.us,Ep,Record,Data\n");
+
+      // merge recorded IN with produced OUT by time
+      uint32_t index = 0;
+      size_t out_idx = 0;
+      for (ik_record_t const &rec : records) {
+        if (!rec.is_in) {
+          continue;
+        }
+        while (out_idx < produced_out.size() &&
+               produced_out[out_idx].time_us <= rec.time_us) {
+          write_record(fp, index++, produced_out[out_idx++]);
+        }
+        write_record(fp, index++, rec);
+      }
+      while (out_idx < produced_out.size()) {
+        write_record(fp, index++, produced_out[out_idx++]);
+      }
+      fclose(fp);
+    }
+  }
+
+  return (strict && !identical) ? 1 : 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Stress the HID report event ring and the membrane snapshot with two threads
+// standing in for the two rp2040 cores: one runs the USB host side
+// (ProcessInput, Periodic), the other polls getHIDReport() or getMembrane().
+// Every report and snapshot must be whole and in order.
+//
+// usage: ik_spsc_stress [iterations]
+
+#include <atomic>
+#include <thread>
+
+#include "Adafruit_IntelliKeys.h"
+#include "host_shim.h"
+
+#define DADDR 1
+
+static Adafruit_IntelliKeys IKeys;
+
+// QWERTY overlay row 9, 2 cols per key
+static uint8_t const keys[] = {HID_KEY_Q, HID_KEY_W, HID_KEY_E,
+                               HID_KEY_R, HID_KEY_T, HID_KEY_Y,
+                               HID_KEY_U, HID_KEY_I, HID_KEY_O};
+#define KEY_COUNT (sizeof(keys) / sizeof(keys[0]))
+
+static std::atomic<bool> consumer_done(false);
+
+void tuh_hid_report_sent_cb(uint8_t dev_addr, uint8_t idx,
+                            uint8_t const *report, uint16_t len) {
+  IKeys.hid_report_sent_cb(dev_addr, idx, report, len);
+}
+
+static void send_event(uint8_t event, uint8_t a = 0, uint8_t b = 0) {
+  uint8_t report[IK_REPORT_LEN] = {event, a, b, 0, 0, 0, 0, 0};
+  IKeys.hid_reprot_received_cb(DADDR, 0, report, IK_REPORT_LEN);
+  IKeys.ProcessInputQueue(); // decode now instead of on next Periodic()
+}
+
+static void run_periodic(uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    host_millis_advance(8);
+    tuh_task();
+    IKeys.Periodic();
+  }
+}
+
+//--------------------------------------------------------------------+
+// Ring only: producer spins while full, nothing may be lost
+//--------------------------------------------------------------------+
+
+typedef struct {
+  uint32_t seq;
+  uint8_t data[28];
+} ring_item_t;
+
+static bool check_ring(uint32_t count) {
+  static IKSpscRing<ring_item_t, 16> ring;
+  uint32_t errors = 0;
+
+  std::thread consumer([&] {
+    ring_item_t item;
+    for (uint32_t expected = 0; expected < count;) {
+      if (!ring.pop(&item)) {
+        std::this_thread::yield(); // may run on a single cpu
+        continue;
+      }
+
+      bool ok = (item.seq == expected);
+      for (uint8_t i = 0; i < sizeof(item.data); i++) {
+        ok &= (item.data[i] == (uint8_t)(expected + i));
+      }
+      if (!ok) {
+        errors++;
+      }
+      expected++;
+    }
+  });
+
+  for (uint32_t seq = 0; seq < count;) {
+    ring_item_t item;
+    item.seq = seq;
+    for (uint8_t i = 0; i < sizeof(item.data); i++) {
+      item.data[i] = (uint8_t)(seq + i);
+    }
+    if (ring.push(item)) {
+      seq++;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  consumer.join();
+
+  printf("ring    : %u items, %u errors\n", count, errors);
+  return errors == 0;
+}
+
+//--------------------------------------------------------------------+
+// Device: press and release keys at full speed while the other thread polls.
+// Each press and release changes the report exactly once, so the sequence
+// number tells which report must be seen: press n is base + 2n + 1 with key
+// n % KEY_COUNT down, and base + 2n + 2 has no key.
+//--------------------------------------------------------------------+
+
+static bool setup_device(void) {
+  IKeys.begin();
+
+  host_device_set(DADDR, IK_VID, IK_PID_RUNNING);
+  if (!IKeys.mount(DADDR)) {
+    printf("mount failed\n");
+    return false;
+  }
+
+  send_event(IK_EVENT_ONOFFSWITCH, 1);
+
+  // overlay number is bit-coded by 3 sensors: QWERTY (5) = 0b101
+  send_event(IK_EVENT_SENSOR_CHANGE, 0, 200);
+  send_event(IK_EVENT_SENSOR_CHANGE, 1, 50);
+  send_event(IK_EVENT_SENSOR_CHANGE, 2, 200);
+
+  run_periodic(200);
+
+  if (IKeys.GetCurrentOverlayNumber() != IK_OVERLAY_QWERTY) {
+    printf("overlay not recognized: %d\n", IKeys.GetCurrentOverlayNumber());
+    return false;
+  }
+
+  return true;
+}
+
+static bool check_device(uint32_t count) {
+  hid_keyboard_report_t kb_report;
+  hid_mouse_report_t mouse_report;
+
+  // consume reports queued while settling
+  uint32_t base = IKeys.getHIDReport(&kb_report, &mouse_report);
+  for (uint8_t i = 0; i < IK_HID_EVENT_DEPTH; i++) {
+    base = IKeys.getHIDReport(&kb_report, &mouse_report);
+  }
+
+  uint32_t const last = base + 2 * count;
+  uint32_t errors = 0;
+  uint32_t seen = 0;
+
+  std::thread consumer([&] {
+    hid_keyboard_report_t kb;
+    hid_mouse_report_t mouse;
+    uint32_t prev = base;
+
+    while (prev < last) {
+      uint32_t const seq = IKeys.getHIDReport(&kb, &mouse);
+      if (seq == prev) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      uint32_t const offset = seq - base;
+      uint8_t const key = (offset & 1) ? keys[(offset / 2) % KEY_COUNT] : 0;
+      hid_keyboard_report_t const kb_expected = {0, 0, {key, 0, 0, 0, 0, 0}};
+      hid_mouse_report_t const mouse_expected = {0, 0, 0, 0, 0};
+
+      if (seq < prev || seq > last ||
+          memcmp(&kb, &kb_expected, sizeof(kb)) ||
+          memcmp(&mouse, &mouse_expected, sizeof(mouse))) {
+        if (errors++ < 10) {
+          printf("seq %u (prev %u): expected %02x, got %02x %02x %02x\n", seq,
+                 prev, key, kb.modifier, kb.keycode[0], kb.keycode[1]);
+        }
+      }
+
+      prev = seq;
+      seen++;
+    }
+
+    consumer_done = true;
+  });
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t const col = (uint8_t)((i % KEY_COUNT) * 2);
+    send_event(IK_EVENT_MEMBRANE_PRESS, col, 9);
+    send_event(IK_EVENT_MEMBRANE_RELEASE, col, 9);
+
+    if ((i & 0x3f) == 0) {
+      run_periodic(1);
+      std::this_thread::yield();
+    }
+  }
+
+  // publish the last report if the ring was full
+  while (!consumer_done) {
+    run_periodic(1);
+    std::this_thread::yield();
+  }
+
+  consumer.join();
+
+  printf("device  : %u reports, %u seen, %u ring full, %u errors\n",
+         2 * count, seen, IKeys.getHIDEventOverflow(), errors);
+  return errors == 0;
+}
+
+//--------------------------------------------------------------------+
+// Membrane snapshot: press and release one cell at a time while the other
+// thread copies the membrane. Snapshot base + 2n + 1 must have only the cell
+// of press n set and base + 2n + 2 must be empty, a torn copy shows none or
+// two cells.
+//--------------------------------------------------------------------+
+
+static void membrane_cell(uint32_t n, uint8_t *row, uint8_t *col) {
+  *row = (uint8_t)(n % IK_RESOLUTION_Y);
+  *col = (uint8_t)((n * 7) % IK_RESOLUTION_X);
+}
+
+static bool check_membrane(uint32_t count) {
+  uint32_t membrane[IK_RESOLUTION_Y];
+  uint32_t const base = IKeys.getMembrane(membrane);
+  uint32_t const last = base + 2 * count;
+  uint32_t errors = 0;
+  uint32_t seen = 0;
+
+  consumer_done = false;
+
+  std::thread consumer([&] {
+    uint32_t snap[IK_RESOLUTION_Y];
+    uint32_t prev = base;
+
+    while (prev < last) {
+      uint32_t const seq = IKeys.getMembrane(snap);
+      if (seq == prev) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      uint32_t const offset = seq - base;
+      uint8_t row = 0, col = 0;
+      membrane_cell((offset - 1) / 2, &row, &col);
+
+      bool ok = (seq > prev) && (seq <= last);
+      for (uint8_t r = 0; r < IK_RESOLUTION_Y; r++) {
+        uint32_t const expected =
+            ((offset & 1) && r == row) ? (1ul << col) : 0;
+        ok &= (snap[r] == expected);
+      }
+
+      if (!ok && errors++ < 10) {
+        printf("snapshot %u (prev %u): unexpected membrane\n", seq, prev);
+      }
+
+      prev = seq;
+      seen++;
+    }
+
+    consumer_done = true;
+  });
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t row, col;
+    membrane_cell(i, &row, &col);
+    send_event(IK_EVENT_MEMBRANE_PRESS, col, row);
+    send_event(IK_EVENT_MEMBRANE_RELEASE, col, row);
+
+    if ((i & 0x3f) == 0) {
+      run_periodic(1);
+      std::this_thread::yield();
+    }
+  }
+
+  consumer.join();
+
+  printf("membrane: %u snapshots, %u seen, %u errors\n", 2 * count, seen,
+         errors);
+  return errors == 0;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t iterations = 20000;
+  if (argc > 1) {
+    iterations = (uint32_t)strtoul(argv[1], NULL, 0);
+  }
+
+  if (!check_ring(iterations * 10) || !setup_device() ||
+      !check_device(iterations) || !check_membrane(iterations)) {
+    return 1;
+  }
+
+  return 0;
+}
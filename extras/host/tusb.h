@@ -0,0 +1,175 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Minimal subset of the TinyUSB host API used by the library so that it can
+// be compiled and exercised on a Linux host. Behavior of the USB side is
+// provided by host_shim.cpp, see host_shim.h for the test controls.
+
+#ifndef ADAFRUIT_INTELLIKEYS_HOST_TUSB_H
+#define ADAFRUIT_INTELLIKEYS_HOST_TUSB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "class/hid/hid.h"
+
+#define TU_ATTR_PACKED __attribute__((packed))
+#define TU_ATTR_WEAK __attribute__((weak))
+
+static inline uint16_t tu_htole16(uint16_t value) { return value; }
+static inline uint16_t tu_le16toh(uint16_t value) { return value; }
+
+static inline uint16_t tu_min16(uint16_t x, uint16_t y) {
+  return (x < y) ? x : y;
+}
+
+//--------------------------------------------------------------------+
+// Control request
+//--------------------------------------------------------------------+
+
+typedef enum {
+  TUSB_DIR_OUT = 0,
+  TUSB_DIR_IN = 1,
+} tusb_dir_t;
+
+typedef enum {
+  TUSB_REQ_TYPE_STANDARD = 0,
+  TUSB_REQ_TYPE_CLASS,
+  TUSB_REQ_TYPE_VENDOR,
+  TUSB_REQ_TYPE_INVALID
+} tusb_request_type_t;
+
+typedef enum {
+  TUSB_REQ_RCPT_DEVICE = 0,
+  TUSB_REQ_RCPT_INTERFACE,
+  TUSB_REQ_RCPT_ENDPOINT,
+  TUSB_REQ_RCPT_OTHER
+} tusb_request_recipient_t;
+
+typedef struct TU_ATTR_PACKED {
+  union {
+    struct TU_ATTR_PACKED {
+      uint8_t recipient : 5;
+      uint8_t type : 2;
+      uint8_t direction : 1;
+    } bmRequestType_bit;
+
+    uint8_t bmRequestType;
+  };
+
+  uint8_t bRequest;
+  uint16_t wValue;
+  uint16_t wIndex;
+  uint16_t wLength;
+} tusb_control_request_t;
+
+typedef enum {
+  XFER_RESULT_SUCCESS = 0,
+  XFER_RESULT_FAILED,
+  XFER_RESULT_STALLED,
+  XFER_RESULT_TIMEOUT,
+  XFER_RESULT_INVALID
+} xfer_result_t;
+
+struct tuh_xfer_s;
+typedef struct tuh_xfer_s tuh_xfer_t;
+typedef void (*tuh_xfer_cb_t)(tuh_xfer_t *xfer);
+
+struct tuh_xfer_s {
+  uint8_t daddr;
+  uint8_t ep_addr;
+  uint8_t result;
+  uint32_t actual_len;
+
+  union {
+    tusb_control_request_t const *setup;
+    uint32_t buflen;
+  };
+
+  uint8_t *buffer;
+  tuh_xfer_cb_t complete_cb;
+  uintptr_t user_data;
+};
+
+//--------------------------------------------------------------------+
+// OSAL & FIFO
+//--------------------------------------------------------------------+
+
+typedef struct {
+  int unused;
+} osal_mutex_def_t;
+typedef osal_mutex_def_t *osal_mutex_t;
+
+#define OSAL_MUTEX_DEF(_name) osal_mutex_def_t _name
+
+static inline osal_mutex_t osal_mutex_create(osal_mutex_def_t *mdef) {
+  return mdef;
+}
+
+typedef struct {
+  uint8_t *buffer;
+  uint16_t depth;
+  uint16_t item_size;
+  bool overwritable;
+
+  volatile uint16_t wr_idx;
+  volatile uint16_t rd_idx;
+  volatile uint16_t count;
+} tu_fifo_t;
+
+bool tu_fifo_config(tu_fifo_t *f, void *buffer, uint16_t depth,
+                    uint16_t item_size, bool overwritable);
+void tu_fifo_config_mutex(tu_fifo_t *f, osal_mutex_t wr_mutex,
+                          osal_mutex_t rd_mutex);
+bool tu_fifo_write(tu_fifo_t *f, void const *data);
+bool tu_fifo_read(tu_fifo_t *f, void *buffer);
+bool tu_fifo_peek(tu_fifo_t *f, void *p_buffer);
+bool tu_fifo_clear(tu_fifo_t *f);
+uint16_t tu_fifo_count(tu_fifo_t *f);
+uint16_t tu_fifo_remaining(tu_fifo_t *f);
+bool tu_fifo_empty(tu_fifo_t *f);
+bool tu_fifo_full(tu_fifo_t *f);
+
+//--------------------------------------------------------------------+
+// Host API
+//--------------------------------------------------------------------+
+
+void tuh_task(void);
+bool tuh_vid_pid_get(uint8_t daddr, uint16_t *vid, uint16_t *pid);
+bool tuh_control_xfer(tuh_xfer_t *xfer);
+bool tuh_interface_set(uint8_t daddr, uint8_t itf_num, uint8_t itf_alt,
+                       tuh_xfer_cb_t complete_cb, uintptr_t user_data);
+
+bool tuh_hid_receive_report(uint8_t dev_addr, uint8_t idx);
+bool tuh_hid_send_ready(uint8_t dev_addr, uint8_t idx);
+bool tuh_hid_send_report(uint8_t dev_addr, uint8_t idx, uint8_t report_id,
+                         void const *report, uint16_t len);
+
+// Invoked from tuh_task() when the in-flight OUT report is sent
+TU_ATTR_WEAK void tuh_hid_report_sent_cb(uint8_t dev_addr, uint8_t idx,
+                                         uint8_t const *report, uint16_t len);
+
+#endif // ADAFRUIT_INTELLIKEYS_HOST_TUSB_H
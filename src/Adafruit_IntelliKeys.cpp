@@ -27,9 +27,19 @@
 #include "Adafruit_IntelliKeys.h"
 #include "intellikeysdefs.h"
 
+#include "ik_ezusb_image.h"
 #include "ik_firmware.h"
 #include "ik_loader.h"
 
+// Packed images of the hex tables, the tables themselves are not linked
+#if IK_EZUSB_COMPRESS
+static constexpr auto ik_loader_image = IK_EZUSB_LZ_IMAGE(ik_loader);
+static constexpr auto ik_firmware_image = IK_EZUSB_LZ_IMAGE(ik_firmware);
+#else
+static constexpr auto ik_loader_image = IK_EZUSB_IMAGE(ik_loader);
+static constexpr auto ik_firmware_image = IK_EZUSB_IMAGE(ik_firmware);
+#endif
+
 //--------------------------------------------------------------------+
 // MACRO TYPEDEF CONSTANT ENUM DECLARATION
 //--------------------------------------------------------------------+
@@ -39,6 +49,9 @@
 #define IK_PID_FWLOAD 0x0100  // Firmware load required
 #define IK_PID_RUNNING 0x0101 // Firmware running
 
+// membrane row is stored as a 32-bit word
+static_assert(IK_RESOLUTION_X <= 32, "membrane row must fit in uint32_t");
+
 #if IK_DEBUG
 
 #define IK_PRINTF(...) Serial.printf(__VA_ARGS__)
@@ -129,6 +142,48 @@ Adafruit_IntelliKeys::Adafruit_IntelliKeys(void)
       m_modAlt(KEYBOARD_MODIFIER_LEFTALT),
       m_modControl(KEYBOARD_MODIFIER_LEFTCTRL),
       m_modCommand(KEYBOARD_MODIFIER_LEFTGUI) {
+  tu_fifo_config(&_streams[IK_STREAM_INTERACTIVE].ff, _interactive_ff_buf,
+                 IK_INTERACTIVE_FIFO_SIZE, 8, false);
+  tu_fifo_config_mutex(&_streams[IK_STREAM_INTERACTIVE].ff,
+                       osal_mutex_create(&_interactive_ff_mutex), NULL);
+
+  tu_fifo_config(&_streams[IK_STREAM_FEEDBACK].ff, _feedback_ff_buf,
+                 IK_FEEDBACK_FIFO_SIZE, 8, false);
+  tu_fifo_config_mutex(&_streams[IK_STREAM_FEEDBACK].ff,
+                       osal_mutex_create(&_feedback_ff_mutex), NULL);
+
+  tu_fifo_config(&_streams[IK_STREAM_BACKGROUND].ff, _cmd_ff_buf,
+                 IK_CMD_FIFO_SIZE, 8, false);
+  tu_fifo_config_mutex(&_streams[IK_STREAM_BACKGROUND].ff,
+                       osal_mutex_create(&_cmd_ff_mutex), NULL);
+
+  // written and read in the USB host context only, no mutex
+  tu_fifo_config(&_input_ff, _input_ff_buf, IK_INPUT_FIFO_SIZE, IK_REPORT_LEN,
+                 false);
+  m_inputOverflow = 0;
+
+  memset(&m_eventStats, 0, sizeof(m_eventStats));
+  memset(&m_overlayStats, 0, sizeof(m_overlayStats));
+  m_eventMode = IK_EVENT_MODE;
+  m_pollInterval = IK_EVENT_POLL_INTERVAL;
+
+  for (uint8_t i = 0; i < 2; i++) {
+    for (uint8_t row = 0; row < IK_RESOLUTION_Y; row++) {
+      m_membraneSnap[i][row].store(0, std::memory_order_relaxed);
+    }
+  }
+  m_membraneSeq.store(0, std::memory_order_relaxed);
+
+  m_reportSeq = 0;
+  memset(&m_hidLast, 0, sizeof(m_hidLast));
+  m_hidPending = false;
+  m_hidOverflow = 0;
+  memset(&m_dlStats, 0, sizeof(m_dlStats)); // kept across re-enumeration
+  memset(&m_startupStats, 0, sizeof(m_startupStats));
+  m_startupBegin = 0;
+  m_startupPending = false;
+  m_startupCold = false;
+  m_calSlot = -1;
   Reset();
 
   _membrane_cb = NULL;
@@ -138,9 +193,6 @@ Adafruit_IntelliKeys::Adafruit_IntelliKeys(void)
   _custom_overlay = NULL;
   _custom_overlay_count = 0;
 
-  tu_fifo_config(&_cmd_ff, _cmd_ff_buf, IK_CMD_FIFO_SIZE, 8, false);
-  tu_fifo_config_mutex(&_cmd_ff, osal_mutex_create(&_cmd_ff_mutex), NULL);
-
   //
 }
 
@@ -148,24 +200,66 @@ void Adafruit_IntelliKeys::Reset(void) {
   _daddr = 0;
   _opened = false;
 
+  m_dlState = IK_DL_IDLE;
+  m_dlBusy = false;
+  m_dlResubmit = false;
+  m_dlRejected = false;
+
   m_lastLEDTime = 0;
-  m_delayUntil = 0;
+  m_ledState = 0;
+  m_ledKnown = 0; // resend all LEDs after re-attach
   m_nextCorrect = 0;
 
+  // drop commands queued for previous device
+  for (uint8_t i = 0; i < IK_STREAM_COUNT; i++) {
+    tu_fifo_clear(&_streams[i].ff);
+    _streams[i].delay_until = 0;
+  }
+
+  // and input received from it
+  tu_fifo_clear(&_input_ff);
+
+  m_pollBusy = false;
+  m_pollBatch = 0;
+  m_pollTime = 0;
+  m_nextPoll = 0;
+
   m_newLevel = 0;
   m_currentLevel = 0;
 
   m_lastOverlay = -1;
   m_lastOverlayTime = 0;
   m_currentOverlay = -1;
+  m_overlayStable = 0;
+  m_overlayStart = 0;
+
+  for (uint8_t i = 0; i < IK_NUM_SENSORS; i++) {
+    m_sensors[i].Reset(IK_SENSOR_MIDWAY);
+  }
+  SensorRestoreCalibration();
+  m_nextSensorTick = 0;
 
   m_toggle = -1;
 
   memset(m_membrane, 0, sizeof(m_membrane));
   memset(m_last_membrane, 0, sizeof(m_last_membrane));
+  MembranePublish();
+  m_pressedCount = 0;
+  m_pressedOverflow = false;
   memset(m_switches, 0, sizeof(m_switches));
 
+  // keep sequence monotonic so that change is seen after re-attach
+  memset(&m_kbReport, 0, sizeof(m_kbReport));
+  memset(&m_mouseReport, 0, sizeof(m_mouseReport));
+  m_cellModifier = 0;
+  m_cellButtons = 0;
+  m_reportSeq++;
+  ReportPublish();
+
+  // read again, device may be another one
   m_bEepromValid = false;
+  memset(m_eepromDataValid, 0, sizeof(m_eepromDataValid));
+  memset(m_eepromRequestTime, 0, sizeof(m_eepromRequestTime));
 
   m_firmwareVersionMajor = 0;
   m_firmwareVersionMinor = 0;
@@ -173,7 +267,9 @@ void Adafruit_IntelliKeys::Reset(void) {
   m_lastSwitch = 0;
 }
 
-void Adafruit_IntelliKeys::begin(void) { IKOverlay::initStandardOverlays(); }
+void Adafruit_IntelliKeys::begin(void) {
+  // nothing to do: standard overlays are generated at compile time
+}
 
 bool Adafruit_IntelliKeys::mount(uint8_t daddr) {
   uint16_t vid, pid;
@@ -189,10 +285,19 @@ bool Adafruit_IntelliKeys::mount(uint8_t daddr) {
 
   if (pid == IK_PID_FWLOAD) {
     IK_PRINTF("IK mounted without firmware\n");
+    m_startupBegin = micros();
+    m_startupCold = true;
+    m_startupPending = true;
     ezusb_StartDevice();
   } else if (pid == IK_PID_RUNNING) {
     IK_PRINTF("IK mounted running firmware\n");
 
+    // re-enumeration after our download is still a cold start
+    if (!m_startupCold) {
+      m_startupBegin = micros();
+    }
+    m_startupPending = true;
+
     if (!tuh_hid_receive_report(_daddr, 0)) {
       IK_PRINTF("Failed to receive report\n");
       return false;
@@ -209,20 +314,41 @@ bool Adafruit_IntelliKeys::mount(uint8_t daddr) {
 
 void Adafruit_IntelliKeys::umount(uint8_t daddr) {
   if (daddr == _daddr) {
+    // device drops off to re-enumerate once our firmware runs, its startup
+    // is still pending. Unplugged at any other time, the startup is abandoned
+    bool const reenumerate =
+        (m_dlState == IK_DL_DONE || m_dlState == IK_DL_REENUMERATE);
+
+    SensorSaveCalibration();
     Reset();
+
+    if (!reenumerate) {
+      m_startupPending = false;
+      m_startupCold = false;
+    }
   }
 }
 
 void Adafruit_IntelliKeys::Periodic(void) {
+  ezusb_DownloadTask();
+
+  ProcessInputQueue();
+
+  // publish report dropped while the event ring was full
+  if (m_hidPending) {
+    ReportPublish();
+  }
+
   if (!IsOpen()) {
     return; // nothing to do
   }
 
-  // settle overlay
-  SettleOverlay();
-
   uint32_t now = millis();
 
+  // filter sensors then settle overlay
+  SensorTick(now);
+  SettleOverlay();
+
   //  setLEDs
   if (now > m_lastLEDTime + 100) {
     SetLEDs();
@@ -235,6 +361,10 @@ void Adafruit_IntelliKeys::Periodic(void) {
     m_nextCorrect = now + 500;
   }
 
+  if (m_eventMode == IK_EVENT_MODE_POLLED) {
+    PollEvents(now);
+  }
+
   //  send for not-yet valid eeprom bytes
   if (!m_bEepromValid) {
     for (uint8_t i = 0; i < sizeof(eeprom_t); i++) {
@@ -252,104 +382,257 @@ void Adafruit_IntelliKeys::Periodic(void) {
   // InterpretRaw();
 }
 
-static bool checkNewKeyboardReport(hid_keyboard_report_t const *report,
-                                   ik_report_keyboard_t *ik_keyboard) {
-  if (ik_keyboard->modifier != 0 &&
-      !(report->modifier & ik_keyboard->modifier)) {
-    return true;
+uint32_t Adafruit_IntelliKeys::getHIDReport(hid_keyboard_report_t *kb_report,
+                                            hid_mouse_report_t *mouse_report) {
+  // report is maintained by membrane events on the USB host side, take the
+  // next one published or repeat the last one
+  ik_hid_event_t event;
+  if (m_hidRing.pop(&event)) {
+    m_hidLast = event;
   }
 
+  *kb_report = m_hidLast.kb;
+  *mouse_report = m_hidLast.mouse;
+
+  // TODO scan switch
+
+  return m_hidLast.seq;
+}
+
+//--------------------------------------------------------------------+
+// HID Report
+// Keyboard and mouse reports are updated incrementally on membrane press and
+// release, modifiers and mouse buttons are only recomputed when a modifier
+// (or button) cell or a latch changes. A key release with 6 keycodes in the
+// report rebuilds it, keys held beyond 6 may be missing from it.
+// m_reportSeq is bumped on every change.
+//--------------------------------------------------------------------+
+
+static bool addKeycode(hid_keyboard_report_t *report, uint8_t keycode) {
   for (uint8_t i = 0; i < 6; i++) {
-    if (ik_keyboard->keycode == report->keycode[i]) {
-      return false;
+    if (report->keycode[i] == keycode) {
+      return false; // already in report
+    }
+    if (report->keycode[i] == 0) {
+      report->keycode[i] = keycode;
+      return true;
     }
   }
+  return false; // report is full
+}
 
-  return true;
+static void removeKeycode(hid_keyboard_report_t *report, uint8_t keycode) {
+  for (uint8_t i = 0; i < 6; i++) {
+    if (report->keycode[i] == keycode) {
+      // shift remaining keys to keep press order
+      for (; i < 5; i++) {
+        report->keycode[i] = report->keycode[i + 1];
+      }
+      report->keycode[5] = 0;
+      return;
+    }
+  }
+}
+
+bool Adafruit_IntelliKeys::ReportIsActive(void) {
+  return IsOpen() && IsSwitchedOn() && (GetCurrentOverlay() != NULL);
+}
+
+uint8_t Adafruit_IntelliKeys::ReportLatchedModifier(void) {
+  uint8_t modifier = 0;
+  IKModifier const *mods[] = {&m_modShift, &m_modAlt, &m_modControl,
+                              &m_modCommand};
+  for (IKModifier const *mod : mods) {
+    if (mod->m_state != kModifierStateOff) {
+      modifier |= mod->m_mask;
+    }
+  }
+  return modifier;
+}
+
+// merge cell and latched state into reports and bump sequence if changed
+void Adafruit_IntelliKeys::ReportCommit(hid_keyboard_report_t const *kb_prev,
+                                        hid_mouse_report_t const *mouse_prev) {
+  m_kbReport.modifier = m_cellModifier | ReportLatchedModifier();
+
+  m_mouseReport.buttons = m_cellButtons;
+  if (m_mouseDown.GetState() != kModifierStateOff) {
+    m_mouseReport.buttons |= MOUSE_BUTTON_LEFT;
+  }
+
+  if (memcmp(kb_prev, &m_kbReport, sizeof(m_kbReport)) ||
+      memcmp(mouse_prev, &m_mouseReport, sizeof(m_mouseReport))) {
+    m_reportSeq++;
+    ReportPublish();
+
+    // latched modifiers are released once applied to a key, the report with
+    // both is published first
+    if (m_kbReport.keycode[0] != 0 && ReportLatchedModifier()) {
+      PostLiftAllModifiers();
+    }
+  }
 }
 
-static void combineMouseReport(hid_mouse_report_t *report,
-                               ik_report_mouse_t *ik_mouse) {
-  report->buttons |= ik_mouse->buttons;
-  report->x += ik_mouse->x;
-  report->y += ik_mouse->y;
+// Push current report to the consumer. If the ring is full the report is
+// published later by Periodic() or replaced by the next change: each event is
+// a full report, so the consumer always ends up with the latest state.
+void Adafruit_IntelliKeys::ReportPublish(void) {
+  ik_hid_event_t const event = {m_reportSeq, m_kbReport, m_mouseReport};
+  if (m_hidRing.push(event)) {
+    m_hidPending = false;
+  } else {
+    if (!m_hidPending) {
+      m_hidOverflow++;
+    }
+    m_hidPending = true;
+  }
 }
 
-void Adafruit_IntelliKeys::getHIDReport(hid_keyboard_report_t *kb_report,
-                                        hid_mouse_report_t *mouse_report) {
-  memset(kb_report, 0, sizeof(hid_keyboard_report_t));
-  memset(mouse_report, 0, sizeof(hid_mouse_report_t));
+void Adafruit_IntelliKeys::ReportAddCell(IKOverlay const *overlay,
+                                         uint8_t row, uint8_t col) {
+  ik_report_t ik_report;
+  overlay->getMembraneReport(row, col, &ik_report);
 
-  if (!IsOpen() || !IsSwitchedOn()) {
+  if (ik_report.type == IK_REPORT_TYPE_KEYBOARD) {
+    m_cellModifier |= ik_report.keyboard.modifier;
+    if (ik_report.keyboard.keycode != 0) {
+      addKeycode(&m_kbReport, ik_report.keyboard.keycode);
+    }
+  } else if (ik_report.type == IK_REPORT_TYPE_MOUSE) {
+    m_cellButtons |= ik_report.mouse.buttons;
+    m_mouseReport.x += ik_report.mouse.x;
+    m_mouseReport.y += ik_report.mouse.y;
+  }
+}
+
+void Adafruit_IntelliKeys::ReportCellPressed(uint8_t row, uint8_t col) {
+  if (!ReportIsActive()) {
     return;
   }
 
-  IKOverlay *overlay = GetCurrentOverlay();
-  if (overlay == NULL) {
+  hid_keyboard_report_t const kb_prev = m_kbReport;
+  hid_mouse_report_t const mouse_prev = m_mouseReport;
+
+  ReportAddCell(GetCurrentOverlay(), row, col);
+  ReportCommit(&kb_prev, &mouse_prev);
+}
+
+// must be called after cell is removed from pressed list
+void Adafruit_IntelliKeys::ReportCellReleased(uint8_t row, uint8_t col) {
+  if (!ReportIsActive()) {
     return;
   }
 
-  uint8_t kb_count = 0;
-
-  //------------- scan membrane -------------//
-  for (uint8_t i = 0; i < IK_RESOLUTION_X; i++) {
-    for (uint8_t j = 0; j < IK_RESOLUTION_Y; j++) {
-      if (m_membrane[i][j] == 1) {
-        ik_report_t ik_report;
-        overlay->getMembraneReport(i, j, &ik_report);
-
-        if (ik_report.type == IK_REPORT_TYPE_KEYBOARD) {
-          // Serial.printf(
-          //    "rol = %u, col = %u, modifier = %02X, keycode = %02X\r\n", i, j,
-          //    ik_report.keyboard.modifier, ik_report.keyboard.keycode);
-          if (checkNewKeyboardReport(kb_report, &ik_report.keyboard)) {
-            kb_report->modifier |= ik_report.keyboard.modifier;
-            if (ik_report.keyboard.keycode != 0) {
-              kb_report->keycode[kb_count] = ik_report.keyboard.keycode;
-              kb_count++;
-              if (kb_count >= 6) {
-                break;
-              }
-            }
-          }
-        } else if (ik_report.type == IK_REPORT_TYPE_MOUSE) {
-          //          Serial.printf(
-          //              "rol = %u, col = %u, buttons = %02X, x = %d, y =
-          //              %d\r\n", i, j, ik_report.mouse.buttons,
-          //              ik_report.mouse.x, ik_report.mouse.y);
-          combineMouseReport(mouse_report, &ik_report.mouse);
+  if (m_pressedOverflow) {
+    ReportRebuild();
+    return;
+  }
+
+  IKOverlay const *overlay = GetCurrentOverlay();
+  ik_report_t ik_report;
+  overlay->getMembraneReport(row, col, &ik_report);
+
+  // a full report may have left held keys out, only a rebuild adds them back
+  if (ik_report.type == IK_REPORT_TYPE_KEYBOARD && m_kbReport.keycode[5]) {
+    ReportRebuild();
+    return;
+  }
+
+  hid_keyboard_report_t const kb_prev = m_kbReport;
+  hid_mouse_report_t const mouse_prev = m_mouseReport;
+
+  if (ik_report.type == IK_REPORT_TYPE_KEYBOARD) {
+    uint8_t const keycode = ik_report.keyboard.keycode;
+    bool keycode_held = false;
+
+    // cells of the same key or other modifier cells may still be pressed
+    if (ik_report.keyboard.modifier) {
+      m_cellModifier = 0;
+    }
+
+    for (uint8_t i = 0; i < m_pressedCount; i++) {
+      ik_report_t other;
+      overlay->getMembraneReport(m_pressed[i].row, m_pressed[i].col, &other);
+      if (other.type == IK_REPORT_TYPE_KEYBOARD) {
+        if (ik_report.keyboard.modifier) {
+          m_cellModifier |= other.keyboard.modifier;
+        }
+        if (keycode && other.keyboard.keycode == keycode) {
+          keycode_held = true;
         }
       }
     }
-  }
 
-  // Check for modifier latching
-  if (m_modShift.GetState() != kModifierStateOff) {
-    kb_report->modifier |= KEYBOARD_MODIFIER_LEFTSHIFT;
+    if (keycode && !keycode_held) {
+      removeKeycode(&m_kbReport, keycode);
+    }
+  } else if (ik_report.type == IK_REPORT_TYPE_MOUSE) {
+    m_mouseReport.x -= ik_report.mouse.x;
+    m_mouseReport.y -= ik_report.mouse.y;
+
+    if (ik_report.mouse.buttons) {
+      m_cellButtons = 0;
+      for (uint8_t i = 0; i < m_pressedCount; i++) {
+        ik_report_t other;
+        overlay->getMembraneReport(m_pressed[i].row, m_pressed[i].col, &other);
+        if (other.type == IK_REPORT_TYPE_MOUSE) {
+          m_cellButtons |= other.mouse.buttons;
+        }
+      }
+    }
   }
 
-  if (m_modAlt.GetState() != kModifierStateOff) {
-    kb_report->modifier |= KEYBOARD_MODIFIER_LEFTALT;
-  }
+  ReportCommit(&kb_prev, &mouse_prev);
+}
 
-  if (m_modControl.GetState() != kModifierStateOff) {
-    kb_report->modifier |= KEYBOARD_MODIFIER_LEFTCTRL;
-  }
+// latched modifiers or mouse down changed
+void Adafruit_IntelliKeys::ReportUpdateModifiers(void) {
+  hid_keyboard_report_t const kb_prev = m_kbReport;
+  hid_mouse_report_t const mouse_prev = m_mouseReport;
 
-  if (m_modCommand.GetState() != kModifierStateOff) {
-    kb_report->modifier |= KEYBOARD_MODIFIER_LEFTGUI;
+  if (ReportIsActive()) {
+    ReportCommit(&kb_prev, &mouse_prev);
   }
+}
 
-  if (kb_count) {
-    PostLiftAllModifiers();
+// Build report from scratch e.g on overlay change, toggle or correction
+void Adafruit_IntelliKeys::ReportRebuild(void) {
+  hid_keyboard_report_t const kb_prev = m_kbReport;
+  hid_mouse_report_t const mouse_prev = m_mouseReport;
+
+  memset(&m_kbReport, 0, sizeof(m_kbReport));
+  memset(&m_mouseReport, 0, sizeof(m_mouseReport));
+  m_cellModifier = 0;
+  m_cellButtons = 0;
+
+  if (!ReportIsActive()) {
+    if (memcmp(&kb_prev, &m_kbReport, sizeof(m_kbReport)) ||
+        memcmp(&mouse_prev, &m_mouseReport, sizeof(m_mouseReport))) {
+      m_reportSeq++;
+      ReportPublish();
+    }
+    return;
   }
 
-  if (!(mouse_report->buttons & MOUSE_BUTTON_LEFT) &&
-      (m_mouseDown.GetState() != kModifierStateOff)) {
-    mouse_report->buttons |= MOUSE_BUTTON_LEFT;
+  IKOverlay const *overlay = GetCurrentOverlay();
+
+  if (!m_pressedOverflow) {
+    for (uint8_t i = 0; i < m_pressedCount; i++) {
+      ReportAddCell(overlay, m_pressed[i].row, m_pressed[i].col);
+    }
+  } else {
+    // too many pressed cells to track, scan the whole bitset
+    for (uint8_t row = 0; row < IK_RESOLUTION_Y; row++) {
+      uint32_t pressed = m_membrane[row];
+      while (pressed) {
+        uint8_t const col = (uint8_t)__builtin_ctz(pressed);
+        pressed &= pressed - 1; // clear lowest set bit
+        ReportAddCell(overlay, row, col);
+      }
+    }
   }
 
-  // TODO scan switch
+  ReportCommit(&kb_prev, &mouse_prev);
 }
 
 void Adafruit_IntelliKeys::InterpretRaw() {
@@ -361,49 +644,54 @@ void Adafruit_IntelliKeys::InterpretRaw() {
     return;
   }
 
-  IKOverlay *overlay = GetCurrentOverlay();
+  IKOverlay const *overlay = GetCurrentOverlay();
 
   //  look for _membrane change
-  for (uint8_t col = 0; col < IK_RESOLUTION_X; col++) {
-    for (uint8_t row = 0; row < IK_RESOLUTION_Y; row++) {
-      const uint8_t state = m_membrane[row][col];
-      if (state != m_last_membrane[row][col]) {
-        IK_PRINTF("membrane [%02u, %02u] = %u\r\n", row, col, state);
-
-        if (state) {
-          ShortKeySound();
-
-          // Modifier Latching
-          if (overlay) {
-            ik_report_t ik_report;
-            overlay->getMembraneReport(row, col, &ik_report);
-
-            if (ik_report.type == IK_REPORT_TYPE_KEYBOARD) {
-              uint8_t const modifier = ik_report.keyboard.modifier;
-
-              m_modControl.UpdateState(modifier);
-              m_modShift.UpdateState(modifier);
-              m_modAlt.UpdateState(modifier);
-              m_modCommand.UpdateState(modifier);
-            } else if (ik_report.type == IK_REPORT_TYPE_MOUSE) {
-              if (ik_report.mouse.buttons & IK_REPORT_MOUSE_CLICK_HOLD) {
-                m_mouseDown.ToggleState();
-              }
-
-              if (ik_report.mouse.buttons &
-                  (MOUSE_BUTTON_LEFT | IK_REPORT_MOUSE_DOUBLE_CLICK)) {
-                m_mouseDown.SetState(kModifierStateOff);
-              }
+  for (uint8_t row = 0; row < IK_RESOLUTION_Y; row++) {
+    uint32_t changed = m_membrane[row] ^ m_last_membrane[row];
+    while (changed) {
+      uint8_t const col = (uint8_t)__builtin_ctz(changed);
+      uint32_t const mask = 1ul << col;
+      changed &= ~mask;
+
+      const uint8_t state = (m_membrane[row] & mask) ? 1 : 0;
+      IK_PRINTF("membrane [%02u, %02u] = %u\r\n", row, col, state);
+
+      if (state) {
+        ShortKeySound();
+
+        // Modifier Latching
+        if (overlay) {
+          ik_report_t ik_report;
+          overlay->getMembraneReport(row, col, &ik_report);
+
+          if (ik_report.type == IK_REPORT_TYPE_KEYBOARD) {
+            uint8_t const modifier = ik_report.keyboard.modifier;
+
+            m_modControl.UpdateState(modifier);
+            m_modShift.UpdateState(modifier);
+            m_modAlt.UpdateState(modifier);
+            m_modCommand.UpdateState(modifier);
+          } else if (ik_report.type == IK_REPORT_TYPE_MOUSE) {
+            if (ik_report.mouse.buttons & IK_REPORT_MOUSE_CLICK_HOLD) {
+              m_mouseDown.ToggleState();
+            }
+
+            if (ik_report.mouse.buttons &
+                (MOUSE_BUTTON_LEFT | IK_REPORT_MOUSE_DOUBLE_CLICK)) {
+              m_mouseDown.SetState(kModifierStateOff);
             }
           }
+
+          ReportUpdateModifiers();
         }
+      }
 
-        // save current state for next time
-        m_last_membrane[row][col] = state;
+      // save current state for next time
+      m_last_membrane[row] ^= mask;
 
-        if (_membrane_cb) {
-          _membrane_cb(row, col, state);
-        }
+      if (_membrane_cb) {
+        _membrane_cb(row, col, state);
       }
     }
   }
@@ -433,13 +721,14 @@ void Adafruit_IntelliKeys::InterpretRaw() {
 bool Adafruit_IntelliKeys::Start(void) {
   uint8_t command[IK_REPORT_LEN] = {0};
 
+  // device setup goes first, ahead of any tone or LED
   command[0] = IK_CMD_INIT;
-  command[1] = 0; //  interrupt event mode
-  PostCommand(command);
+  command[1] = m_eventMode; //  interrupt or polled event mode
+  PostCommand(command, IK_STREAM_INTERACTIVE);
 
   command[0] = IK_CMD_SCAN;
   command[1] = 1; //  enable
-  PostCommand(command);
+  PostCommand(command, IK_STREAM_INTERACTIVE);
 
   PostDelay(250);
 
@@ -459,10 +748,73 @@ bool Adafruit_IntelliKeys::Start(void) {
   ResetMouse();
 
   _opened = true;
+  ReportRebuild();
 
   return false;
 }
 
+// Version of our firmware, learned from a device we downloaded if unknown
+static uint8_t _fw_version_major = IK_FIRMWARE_VERSION_MAJOR;
+static uint8_t _fw_version_minor = IK_FIRMWARE_VERSION_MINOR;
+
+// Firmware version is the first reply after Start(): device is ready. A warm
+// device only skips the download if it runs our firmware, otherwise the 8051
+// is halted and our firmware is downloaded (anchor load works whatever
+// firmware is running).
+void Adafruit_IntelliKeys::OnFirmwareVersion(uint8_t major, uint8_t minor) {
+  m_firmwareVersionMajor = major;
+  m_firmwareVersionMinor = minor;
+
+  bool const cold = m_startupCold;
+
+  if (m_startupPending) {
+    uint32_t const elapsed = micros() - m_startupBegin;
+    if (cold) {
+      m_startupStats.cold_us = elapsed;
+      m_startupStats.cold_count++;
+    } else {
+      m_startupStats.warm_us = elapsed;
+      m_startupStats.warm_count++;
+    }
+
+    m_startupPending = false;
+    m_startupCold = false;
+
+    IK_PRINTF("IK ready in %lu us (%s start), firmware %u.%u\n",
+              (unsigned long)elapsed, cold ? "cold" : "warm", major, minor);
+  }
+
+  if (_fw_version_major == 0 && _fw_version_minor == 0) {
+    if (cold) {
+      _fw_version_major = major;
+      _fw_version_minor = minor;
+    }
+    return; // unknown, accept any
+  }
+
+  if (major == _fw_version_major && minor == _fw_version_minor) {
+    return;
+  }
+
+  if (cold) {
+    // don't download again and again
+    IK_PRINTF("Downloaded firmware reports %u.%u, expected %u.%u\n", major,
+              minor, _fw_version_major, _fw_version_minor);
+    return;
+  }
+
+  IK_PRINTF("IK running unknown firmware %u.%u\n", major, minor);
+
+  uint8_t const daddr = _daddr;
+  Reset();
+  _daddr = daddr;
+
+  m_startupBegin = micros();
+  m_startupCold = true;
+  m_startupPending = true;
+  ezusb_StartDevice();
+}
+
 bool Adafruit_IntelliKeys::IsNumLockOn(void) {
   // implement later
   return false;
@@ -483,11 +835,8 @@ void Adafruit_IntelliKeys::DoCorrect(void) {
     m_switchesPressedInCorrectMode[i] = 0;
   }
 
-  for (int x = 0; x < IK_RESOLUTION_X; x++) {
-    for (int y = 0; y < IK_RESOLUTION_Y; y++) {
-      m_membranePressedInCorrectMode[y][x] = 0;
-    }
-  }
+  memset(m_membranePressedInCorrectMode, 0,
+         sizeof(m_membranePressedInCorrectMode));
 
   //  send the command
   uint8_t report[IK_REPORT_LEN] = {IK_CMD_CORRECT, 0, 0, 0, 0, 0, 0, 0};
@@ -495,7 +844,9 @@ void Adafruit_IntelliKeys::DoCorrect(void) {
 }
 
 void Adafruit_IntelliKeys::OnCorrectMembrane(int x, int y) {
-  m_membranePressedInCorrectMode[y][x] = true;
+  if (x < IK_RESOLUTION_X && y < IK_RESOLUTION_Y) {
+    m_membranePressedInCorrectMode[y] |= (1ul << x);
+  }
 }
 
 void Adafruit_IntelliKeys::OnCorrectSwitch(int switchnum) {
@@ -508,104 +859,331 @@ void Adafruit_IntelliKeys::OnCorrectDone() {
     m_switches[i] = m_switchesPressedInCorrectMode[i];
   }
 
-  for (int x = 0; x < IK_RESOLUTION_X; x++) {
-    for (int y = 0; y < IK_RESOLUTION_Y; y++) {
-      m_membrane[y][x] = m_membranePressedInCorrectMode[y][x];
+  bool changed = false;
+
+  for (uint8_t row = 0; row < IK_RESOLUTION_Y; row++) {
+    uint32_t const corrected = m_membranePressedInCorrectMode[row];
+    if (corrected == m_membrane[row]) {
+      continue;
+    }
+    changed = true;
+
+    // drop cells no longer pressed
+    uint32_t released = m_membrane[row] & ~corrected;
+    while (released) {
+      uint8_t const col = (uint8_t)__builtin_ctz(released);
+      released &= released - 1;
+      PressedListRemove(row, col);
+    }
+
+    // append cells pressed but missed
+    uint32_t pressed = corrected & ~m_membrane[row];
+    while (pressed) {
+      uint8_t const col = (uint8_t)__builtin_ctz(pressed);
+      pressed &= pressed - 1;
+      PressedListAdd(row, col);
     }
+
+    m_membrane[row] = corrected;
+  }
+
+  if (m_pressedOverflow) {
+    PressedListRebuild();
+  }
+
+  if (changed) {
+    MembranePublish();
+    ReportRebuild();
   }
 }
 
 void Adafruit_IntelliKeys::OnMembranePress(int x, int y) {
-  m_membrane[y][x] = 1;
+  if (x < IK_RESOLUTION_X && y < IK_RESOLUTION_Y) {
+    uint32_t const mask = 1ul << x;
+    if (!(m_membrane[y] & mask)) {
+      m_membrane[y] |= mask;
+      MembranePublish();
+      PressedListAdd(y, x);
+      ReportCellPressed(y, x);
+    }
+  }
 }
 
 void Adafruit_IntelliKeys::OnMembraneRelease(int x, int y) {
-  m_membrane[y][x] = 0;
+  if (x < IK_RESOLUTION_X && y < IK_RESOLUTION_Y) {
+    uint32_t const mask = 1ul << x;
+    if (m_membrane[y] & mask) {
+      m_membrane[y] &= ~mask;
+      MembranePublish();
+      PressedListRemove(y, x);
+
+      if (m_pressedOverflow) {
+        PressedListRebuild();
+      }
+
+      ReportCellReleased(y, x);
+    }
+  }
 }
 
-// All commands processed in this function is sent to device
-void Adafruit_IntelliKeys::ProcessCommands() {
-  uint8_t const idx = 0;
+void Adafruit_IntelliKeys::PressedListAdd(uint8_t row, uint8_t col) {
+  if (m_pressedCount < IK_MAX_PRESSED_CELLS) {
+    m_pressed[m_pressedCount].row = row;
+    m_pressed[m_pressedCount].col = col;
+    m_pressedCount++;
+  } else {
+    m_pressedOverflow = true;
+  }
+}
 
-  //  come back later if IK_ICMD_DELAY has set a future time
-  if (millis() < m_delayUntil) {
-    return;
+void Adafruit_IntelliKeys::PressedListRemove(uint8_t row, uint8_t col) {
+  for (uint8_t i = 0; i < m_pressedCount; i++) {
+    if (m_pressed[i].row == row && m_pressed[i].col == col) {
+      // shift remaining entries to keep press order
+      m_pressedCount--;
+      memmove(&m_pressed[i], &m_pressed[i + 1],
+              (m_pressedCount - i) * sizeof(m_pressed[0]));
+      return;
+    }
   }
+}
 
-  if (!tuh_hid_send_ready(_daddr, idx)) {
-    return;
+// Re-create list from bitset (row-major order) after an overflow
+void Adafruit_IntelliKeys::PressedListRebuild(void) {
+  m_pressedCount = 0;
+  m_pressedOverflow = false;
+
+  for (uint8_t row = 0; row < IK_RESOLUTION_Y && !m_pressedOverflow; row++) {
+    uint32_t pressed = m_membrane[row];
+    while (pressed) {
+      uint8_t const col = (uint8_t)__builtin_ctz(pressed);
+      pressed &= pressed - 1;
+      PressedListAdd(row, col);
+    }
   }
+}
 
-  uint8_t command[IK_REPORT_LEN] = {0};
+//--------------------------------------------------------------------+
+// Membrane snapshot
+// Seqlock with two buffers: the writer marks the sequence odd, fills the
+// buffer not being read and makes it current by bumping the sequence again.
+// A reader copies the current buffer, which is only rewritten by the publish
+// after the next one, so it retries only when two publishes overlap its copy.
+//--------------------------------------------------------------------+
 
-  if (!tu_fifo_read(&_cmd_ff, command)) {
-    return;
+void Adafruit_IntelliKeys::MembranePublish(void) {
+  uint32_t const seq = m_membraneSeq.load(std::memory_order_relaxed);
+  uint8_t const idx = ((seq >> 1) + 1) & 1;
+
+  m_membraneSeq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (uint8_t row = 0; row < IK_RESOLUTION_Y; row++) {
+    m_membraneSnap[idx][row].store(m_membrane[row], std::memory_order_relaxed);
   }
 
-  uint8_t const cmd_id = command[0];
+  m_membraneSeq.store(seq + 2, std::memory_order_release);
+}
+
+uint32_t Adafruit_IntelliKeys::getMembrane(uint32_t membrane[IK_RESOLUTION_Y]) {
+  while (1) {
+    uint32_t const seq = m_membraneSeq.load(std::memory_order_acquire);
+    uint8_t const idx = (seq >> 1) & 1;
+
+    for (uint8_t row = 0; row < IK_RESOLUTION_Y; row++) {
+      membrane[row] = m_membraneSnap[idx][row].load(std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (m_membraneSeq.load(std::memory_order_relaxed) - (seq & ~1u) <= 2) {
+      return seq >> 1;
+    }
+  }
+}
+
+// a single row is always coherent, no retry needed
+bool Adafruit_IntelliKeys::isMembranePressed(uint8_t row, uint8_t col) {
+  if (row >= IK_RESOLUTION_Y || col >= IK_RESOLUTION_X) {
+    return false;
+  }
+
+  uint32_t const seq = m_membraneSeq.load(std::memory_order_acquire);
+  uint32_t const bits =
+      m_membraneSnap[(seq >> 1) & 1][row].load(std::memory_order_relaxed);
+  return (bits >> col) & 1u;
+}
+
+// All commands processed in this function is sent to device
+// Send as many queued commands as the OUT endpoint accepts without blocking.
+// Called from Periodic() and chained from hid_report_sent_cb() when the
+// previous command is sent. Every command is taken from the highest priority
+// stream that has one ready, a stream on hold by IK_CMD_DELAY does not stall
+// the others.
+void Adafruit_IntelliKeys::ProcessCommands() {
+  uint32_t const now = millis();
+  bool sent;
+
+  do {
+    sent = false;
+    for (uint8_t stream = 0; stream < IK_STREAM_COUNT && !sent; stream++) {
+      sent = ProcessStream(stream, now);
+    }
+  } while (sent);
+}
+
+// Run local commands at head of stream and send its next device command.
+// Return true if a command is sent. A command that cannot be sent stays in
+// the stream.
+bool Adafruit_IntelliKeys::ProcessStream(uint8_t stream, uint32_t now) {
+  uint8_t const idx = 0;
+  ik_cmd_stream_t *st = &_streams[stream];
+  uint8_t command[IK_REPORT_LEN];
+
+  while (tu_fifo_peek(&st->ff, command)) {
+    //  come back later if IK_CMD_DELAY has set a future time
+    if ((int32_t)(now - st->delay_until) < 0) {
+      return false;
+    }
+
+    uint8_t const cmd_id = command[0];
+
+    if (cmd_id >= COMMAND_BASE) {
+      // local command, only delay is queued
+      if (cmd_id == IK_CMD_DELAY) {
+        st->delay_until = now + (uint16_t)(command[1] | (command[2] << 8));
+      }
+      tu_fifo_read(&st->ff, command); // consumed
+      continue;
+    }
+
+    // endpoint is busy with previous command, wait for sent callback
+    if (!tuh_hid_send_ready(_daddr, idx)) {
+      return false;
+    }
 
-  if (cmd_id < COMMAND_BASE) {
     if (cmd_id > IK_CMD_REFLECT_MOUSE_MOVE) {
       IK_PRINTF("ProcessCommand: invalid cmd %d\r\n", cmd_id);
     } else {
       IK_PRINTF2("ProcessCommand: %s\r\n", ik_cmd_str[cmd_id]);
     }
 
-    // blocking until report is sent
-    while (!tuh_hid_send_report(_daddr, idx, 0, command, IK_REPORT_LEN)) {
-      tuh_task();
+    if (!tuh_hid_send_report(_daddr, idx, 0, command, IK_REPORT_LEN)) {
+      return false; // try again later
     }
+
+    tu_fifo_read(&st->ff, command); // consumed
+    return true;
   }
+
+  return false;
 }
 
-bool Adafruit_IntelliKeys::PostCommand(uint8_t *command) {
+bool Adafruit_IntelliKeys::PostCommand(uint8_t *command, uint8_t stream) {
   uint8_t const cmd_id = command[0];
 
+  if (stream >= IK_STREAM_COUNT) {
+    return false;
+  }
+
   if (cmd_id < COMMAND_BASE) {
     if (cmd_id > IK_CMD_REFLECT_MOUSE_MOVE) {
       IK_PRINTF("PostCommand: invalid cmd %d\r\n", cmd_id);
       return false;
     }
     // IK_PRINTF("PostCommand: %s\r\n", ik_cmd_str[cmd_id]);
-
-    // queue command sent to device
-    if (!tu_fifo_write(&_cmd_ff, command)) {
-      IK_PRINTF("PostCommand: Failed to queue command, probably full. Please "
-                "increase IK_CMD_FIFO_SIZE\n");
-    }
   } else {
     // local driver command
     if (cmd_id > IK_CMD_CP_REPORT_REALTIME) {
       IK_PRINTF("PostCommand (local): invalid cmd %d\r\n", cmd_id);
       return false;
-    } else {
-      IK_PRINTF("PostCommand (local): %s\r\n",
-                ik_cmd_local_str[cmd_id - COMMAND_BASE]);
+    }
 
-      switch (cmd_id) {
-      case IK_CMD_DELAY:
-        m_delayUntil = millis() + command[1];
-        break;
+    IK_PRINTF("PostCommand (local): %s\r\n",
+              ik_cmd_local_str[cmd_id - COMMAND_BASE]);
 
-      default:
-        break;
-      }
+    // delay is queued and run in order with the stream, others are no-op
+    if (cmd_id != IK_CMD_DELAY) {
+      return true;
     }
   }
 
+  // queue command sent to device
+  if (!tu_fifo_write(&_streams[stream].ff, command)) {
+    IK_PRINTF("PostCommand: Failed to queue command, stream %u is full\n",
+              stream);
+    return false;
+  }
+
   return true;
 }
 
-void Adafruit_IntelliKeys::PostSetLED(uint8_t number, uint8_t value) {
+void Adafruit_IntelliKeys::PostSetLED(uint8_t number, uint8_t value,
+                                      uint8_t stream) {
+  if (number < 1 || number > IK_NUM_LEDS) {
+    return;
+  }
+
+  uint16_t const mask = (uint16_t)(1u << (number - 1));
+  uint16_t const state = value ? mask : 0;
+
+  // skip if LED is already (or queued to be) in this state
+  if ((m_ledKnown & mask) && (m_ledState & mask) == state) {
+    return;
+  }
+
   uint8_t command[IK_REPORT_LEN] = {IK_CMD_LED, number, value, 0, 0, 0, 0, 0};
-  PostCommand(command);
+  if (PostCommand(command, stream)) {
+    m_ledState = (m_ledState & ~mask) | state;
+    m_ledKnown |= mask;
+  } else {
+    m_ledKnown &= ~mask;
+  }
 }
 
-void Adafruit_IntelliKeys::PostDelay(uint8_t msec) {
-  uint8_t command[IK_REPORT_LEN];
+// Set all LEDs, LED n is bit (n-1) of leds. Only changed LEDs are sent, and
+// when many of them change a single IK_CMD_ALL_LEDS is used whose payload is
+// the same bitmask: LED 1-8 in byte 1 and LED 9 in bit 0 of byte 2.
+void Adafruit_IntelliKeys::PostSetLEDs(uint16_t leds, uint8_t stream) {
+  uint16_t const all = (uint16_t)((1u << IK_NUM_LEDS) - 1);
+  leds &= all;
+
+  uint16_t const changed = ((m_ledState ^ leds) | ~m_ledKnown) & all;
+  if (!changed) {
+    return;
+  }
+
+#if IK_LED_BATCH_THRESHOLD
+  uint8_t const count = (uint8_t)__builtin_popcount(changed);
+
+  if (count >= IK_LED_BATCH_THRESHOLD) {
+    uint8_t command[IK_REPORT_LEN] = {
+        IK_CMD_ALL_LEDS, (uint8_t)(leds & 0xff), (uint8_t)(leds >> 8), 0, 0, 0,
+        0, 0};
+    if (PostCommand(command, stream)) {
+      m_ledState = leds;
+      m_ledKnown = all;
+    } else {
+      m_ledKnown = 0;
+    }
+    return;
+  }
+#endif
+
+  for (uint8_t number = 1; number <= IK_NUM_LEDS; number++) {
+    uint16_t const mask = (uint16_t)(1u << (number - 1));
+    if (changed & mask) {
+      PostSetLED(number, (leds & mask) ? 1 : 0, stream);
+    }
+  }
+}
+
+// Hold back later commands of the stream for msec
+void Adafruit_IntelliKeys::PostDelay(uint16_t msec, uint8_t stream) {
+  uint8_t command[IK_REPORT_LEN] = {0};
   command[0] = IK_CMD_DELAY;
-  command[1] = msec; //  msec delay
-  PostCommand(command);
+  command[1] = msec & 0xff; //  msec delay
+  command[2] = msec >> 8;
+  PostCommand(command, stream);
 }
 
 void Adafruit_IntelliKeys::PostKey(int code, int direction, int delayAfter) {
@@ -629,6 +1207,11 @@ void Adafruit_IntelliKeys::PostKey(int code, int direction, int delayAfter) {
   PostCommand(command);
 }
 
+// LED n is bit (n-1)
+static inline uint16_t led(uint8_t number, bool on) {
+  return on ? (uint16_t)(1u << (number - 1)) : 0;
+}
+
 void Adafruit_IntelliKeys::SetLEDs(void) {
   if (!IsSwitchedOn()) {
     return;
@@ -638,6 +1221,11 @@ void Adafruit_IntelliKeys::SetLEDs(void) {
     return;
   }
 
+  // LED animation in progress, LEDs are restored once it is done
+  if (!tu_fifo_empty(&_streams[IK_STREAM_FEEDBACK].ff)) {
+    return;
+  }
+
   bool bShift = (m_modShift.GetState() != 0);
   bool bControl = (m_modControl.GetState() != 0);
   bool bAlt = (m_modAlt.GetState() != 0);
@@ -647,30 +1235,19 @@ void Adafruit_IntelliKeys::SetLEDs(void) {
   bool bCapsLock = IsCapsLockOn();
 
   //  3 lights is shift, caps lock, mouse down
-  PostSetLED(1, bShift);
-  PostSetLED(4, bCapsLock);
-  PostSetLED(7, bMouse);
+  uint16_t leds = led(1, bShift) | led(4, bCapsLock) | led(7, bMouse);
 
   //  6 lights is alt, control/command, num lock
   bool b6lights =
       (IKSettings::GetSettings()->m_iIndicatorLights == kSettings6lights);
   if (b6lights) {
-    PostSetLED(2, bAlt);
-    PostSetLED(5, bControl || bCommand);
-    PostSetLED(8, bNumLock);
-
-    PostSetLED(3, false);
-    PostSetLED(6, false);
-    PostSetLED(9, false);
+    leds |= led(2, bAlt) | led(5, bControl || bCommand) | led(8, bNumLock);
   } else {
-    PostSetLED(3, bShift);
-    PostSetLED(6, bCapsLock);
-    PostSetLED(9, bMouse);
-
-    PostSetLED(2, false);
-    PostSetLED(5, false);
-    PostSetLED(8, false);
+    leds |= led(3, bShift) | led(6, bCapsLock) | led(9, bMouse);
   }
+
+  // only changed LEDs are sent
+  PostSetLEDs(leds);
 }
 
 void Adafruit_IntelliKeys::SweepSound(int iStartFreq, int iEndFreq,
@@ -687,7 +1264,7 @@ void Adafruit_IntelliKeys::SweepSound(int iStartFreq, int iEndFreq,
   for (int i = 0; i < iLoops; i++) {
     report[1] = iStartFreq + i * ((iEndFreq - iStartFreq) * 100 / iLoops) / 100;
     report[2] = volume;
-    PostCommand(report);
+    PostCommand(report, IK_STREAM_FEEDBACK);
 
     j++;
     if (j == 5) {
@@ -697,24 +1274,26 @@ void Adafruit_IntelliKeys::SweepSound(int iStartFreq, int iEndFreq,
         bOn = !bOn;
         nLight = 1;
       }
-      PostSetLED(nLight, bOn);
+      PostSetLED(nLight, bOn, IK_STREAM_FEEDBACK);
     }
   }
 
   report[2] = 0;
-  PostCommand(report);
+  PostCommand(report, IK_STREAM_FEEDBACK);
 
   //  restore lights
   for (int i2 = 0; i2 < 9; i2++) {
-    PostSetLED(i2 + 1, false);
+    PostSetLED(i2 + 1, false, IK_STREAM_FEEDBACK);
   }
 }
 
-void Adafruit_IntelliKeys::PostReportDataToControlPanel(bool bForce) {
+// Control panel realtime report is not supported. Byte 1 forces the report,
+// the original driver set it after IK_EVENT_CORRECT_DONE.
+void Adafruit_IntelliKeys::PostReportDataToControlPanel(void) {
 #if 0
   PostDelay(5);
   uint8_t command[IK_REPORT_LEN] = {
-      IK_CMD_CP_REPORT_REALTIME, bForce, 0, 0, 0, 0, 0, 0};
+      IK_CMD_CP_REPORT_REALTIME, 0, 0, 0, 0, 0, 0, 0};
   PostCommand(command);
 #endif
 }
@@ -742,6 +1321,8 @@ void Adafruit_IntelliKeys::OnToggle(int newValue) {
     //  reset mouse
     ResetMouse();
 
+    ReportRebuild();
+
     // IKControlPanel::Refresh();
 
     if (_toggle_cb) {
@@ -755,39 +1336,200 @@ void Adafruit_IntelliKeys::OnSwitch(int nswitch, int state) {
 }
 
 void Adafruit_IntelliKeys::OnSensorChange(int sensor, int value) {
-  uint32_t now = millis();
-
-  //  save the current sensor value
-  m_sensors[sensor] = value;
+  //  only hold the value, it is filtered by SensorTick()
+  if (sensor >= 0 && sensor < IK_NUM_SENSORS) {
+    m_sensors[sensor].OnChange((uint8_t)value);
+  }
+}
 
-  //  what's the new overlay value
-  int v[IK_NUM_SENSORS];
+void Adafruit_IntelliKeys::SensorTick(uint32_t now) {
+  if ((int32_t)(now - m_nextSensorTick) < 0) {
+    return;
+  }
+  m_nextSensorTick = now + IK_SENSOR_PERIOD;
 
+  bool sampled = false;
+  bool confident = true;
   for (int i = 0; i < IK_NUM_SENSORS; i++) {
-    v[i] = 0;
-    int midway;
-    if (m_bEepromValid) {
-      midway = (50 * m_eepromData.sensorBlack[i] +
-                50 * m_eepromData.sensorWhite[i]) /
-               100;
-    } else {
-      midway = 150;
-    }
+    sampled |= m_sensors[i].Sample();
+    confident = confident && m_sensors[i].IsConfident();
+  }
 
-    if (m_sensors[i] > midway) {
-      v[i] = 1;
-    }
+  //  nothing new and no overlay waiting to be confirmed
+  if (!sampled && m_lastOverlay == m_currentOverlay) {
+    return;
   }
 
+  //  what's the new overlay value
   int newVal = 0;
   for (int i = 0; i < IK_NUM_SENSORS; i++) {
-    newVal += v[i] * (1 << i);
+    if (m_sensors[i].IsSet()) {
+      newVal |= (1 << i);
+    }
   }
 
   //  if the value changed, record what and when
   if (newVal != m_lastOverlay) {
+    if (m_lastOverlay == m_currentOverlay) {
+      m_overlayStart = now;
+    }
     m_lastOverlay = newVal;
     m_lastOverlayTime = now;
+    m_overlayStable = 0;
+  }
+
+  //  count samples agreeing on it, well away from the thresholds
+  if (!confident) {
+    m_overlayStable = 0;
+  } else if (m_overlayStable < IK_OVERLAY_STABLE_COUNT) {
+    m_overlayStable++;
+  }
+}
+
+//--------------------------------------------------------------------+
+// Sensor calibration
+//--------------------------------------------------------------------+
+
+// Calibration per device, shared by all instances. RAM only, lost on reset
+typedef struct {
+  uint8_t serial[IK_EEPROM_SN_SIZE];
+  uint8_t low[IK_NUM_SENSORS];
+  uint8_t high[IK_NUM_SENSORS]; // same as low if not known
+  uint32_t age;                 // save count when last saved, 0 if empty
+} ik_sensor_cal_t;
+
+static ik_sensor_cal_t _sensor_cal[IK_SENSOR_CAL_SLOTS];
+static uint32_t _sensor_cal_age;
+
+static int8_t sensor_cal_find(uint8_t const *serial) {
+  for (int8_t i = 0; i < IK_SENSOR_CAL_SLOTS; i++) {
+    if (_sensor_cal[i].age &&
+        !memcmp(_sensor_cal[i].serial, serial, IK_EEPROM_SN_SIZE)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Once the EEPROM is read: midway between factory black and white, replaced
+// by calibration saved for this serial number if any
+void Adafruit_IntelliKeys::SensorUpdateThresholds(void) {
+  for (int i = 0; i < IK_NUM_SENSORS; i++) {
+    uint8_t const black = m_eepromData.sensorBlack[i];
+    uint8_t const white = m_eepromData.sensorWhite[i];
+    if (black < white) {
+      m_sensors[i].SetCalibration(black, white);
+    } else {
+      m_sensors[i].SetCalibration(white, black);
+    }
+  }
+
+  m_calSlot = sensor_cal_find(m_eepromData.serialnumber);
+  SensorRestoreCalibration();
+}
+
+// Until the EEPROM is read, the last device seen by this instance is the
+// likely one: use its calibration so that a device plugged back is recognized
+// from the first sample. Another device is corrected once its EEPROM is read.
+void Adafruit_IntelliKeys::SensorRestoreCalibration(void) {
+  if (m_calSlot < 0 || !_sensor_cal[m_calSlot].age) {
+    return;
+  }
+
+  ik_sensor_cal_t const *cal = &_sensor_cal[m_calSlot];
+  for (int i = 0; i < IK_NUM_SENSORS; i++) {
+    if (cal->high[i] > cal->low[i]) {
+      m_sensors[i].SetCalibration(cal->low[i], cal->high[i]);
+    }
+  }
+}
+
+// Save calibration of a device identified by its EEPROM, replacing the least
+// recently saved slot of another device if needed
+void Adafruit_IntelliKeys::SensorSaveCalibration(void) {
+  if (!m_bEepromValid) {
+    return;
+  }
+
+  if (m_calSlot < 0 || memcmp(_sensor_cal[m_calSlot].serial,
+                              m_eepromData.serialnumber, IK_EEPROM_SN_SIZE)) {
+    m_calSlot = sensor_cal_find(m_eepromData.serialnumber);
+  }
+
+  if (m_calSlot < 0) {
+    m_calSlot = 0;
+    for (int8_t i = 1; i < IK_SENSOR_CAL_SLOTS; i++) {
+      if (_sensor_cal[i].age < _sensor_cal[m_calSlot].age) {
+        m_calSlot = i;
+      }
+    }
+  }
+
+  ik_sensor_cal_t *cal = &_sensor_cal[m_calSlot];
+  memcpy(cal->serial, m_eepromData.serialnumber, IK_EEPROM_SN_SIZE);
+  for (int i = 0; i < IK_NUM_SENSORS; i++) {
+    if (!m_sensors[i].GetCalibration(&cal->low[i], &cal->high[i])) {
+      cal->low[i] = cal->high[i] = 0;
+    }
+  }
+  cal->age = ++_sensor_cal_age;
+}
+
+//--------------------------------------------------------------------+
+// Polled event mode
+//--------------------------------------------------------------------+
+
+// start a batch every poll interval, unless one is running
+void Adafruit_IntelliKeys::PollEvents(uint32_t now) {
+  if (m_pollBusy) {
+    if (now - m_pollTime < IK_EVENT_POLL_TIMEOUT) {
+      return;
+    }
+
+    // reply lost, start over
+    m_eventStats.timeouts++;
+    m_pollBusy = false;
+    m_pollBatch = 0;
+  }
+
+  if ((int32_t)(now - m_nextPoll) >= 0) {
+    PostGetEvent();
+  }
+}
+
+// on the interactive stream so that a batch is not held back by animations
+void Adafruit_IntelliKeys::PostGetEvent(void) {
+  uint8_t command[IK_REPORT_LEN] = {IK_CMD_GET_EVENT, 0, 0, 0, 0, 0, 0, 0};
+  m_pollBusy = PostCommand(command, IK_STREAM_INTERACTIVE);
+  if (m_pollBusy) {
+    m_pollTime = millis();
+    m_eventStats.polls++;
+  }
+}
+
+// any report while a poll is out continues the batch until no more events
+void Adafruit_IntelliKeys::OnPolledEvent(uint8_t event_id) {
+  if (event_id == IK_EVENT_NOMOREEVENTS) {
+    m_pollBusy = false;
+    m_nextPoll = millis() + m_pollInterval;
+
+    m_eventStats.batches++;
+    if (m_pollBatch > m_eventStats.max_batch) {
+      m_eventStats.max_batch = m_pollBatch;
+    }
+    m_pollBatch = 0;
+  } else {
+    m_eventStats.events++;
+    m_pollBatch++;
+    PostGetEvent();
+  }
+}
+
+// Decode input reports queued by hid_reprot_received_cb() in received order
+void Adafruit_IntelliKeys::ProcessInputQueue(void) {
+  uint8_t report[IK_REPORT_LEN];
+  while (tu_fifo_read(&_input_ff, report)) {
+    ProcessInput(report, IK_REPORT_LEN);
   }
 }
 
@@ -804,6 +1546,10 @@ void Adafruit_IntelliKeys::ProcessInput(uint8_t const *data, uint8_t len) {
   }
 #endif
 
+  if (m_pollBusy) {
+    OnPolledEvent(event_id);
+  }
+
   switch (event_id) {
   case IK_EVENT_MEMBRANE_PRESS:
     OnMembranePress(data[1], data[2]);
@@ -829,8 +1575,7 @@ void Adafruit_IntelliKeys::ProcessInput(uint8_t const *data, uint8_t len) {
 
   case IK_EVENT_VERSION:
     // JR - June 2012 - set the firmware version
-    m_firmwareVersionMajor = data[1];
-    m_firmwareVersionMinor = data[2];
+    OnFirmwareVersion(data[1], data[2]);
     break;
 
   case IK_EVENT_EEPROM_READ:
@@ -855,7 +1600,7 @@ void Adafruit_IntelliKeys::ProcessInput(uint8_t const *data, uint8_t len) {
 
   case IK_EVENT_CORRECT_DONE:
     OnCorrectDone();
-    PostReportDataToControlPanel(true);
+    PostReportDataToControlPanel();
     break;
 
   case IK_EVENT_EEPROM_READBYTE:
@@ -865,6 +1610,10 @@ void Adafruit_IntelliKeys::ProcessInput(uint8_t const *data, uint8_t len) {
   case IK_EVENT_AUTOPILOT_STATE:
     break;
 
+  case IK_EVENT_NOMOREEVENTS:
+    // end of polled batch, handled above
+    break;
+
   default:
     break;
 
@@ -872,7 +1621,6 @@ void Adafruit_IntelliKeys::ProcessInput(uint8_t const *data, uint8_t len) {
 
   case IK_EVENT_ACK:
   case IK_EVENT_DEVICEREADY:
-  case IK_EVENT_NOMOREEVENTS:
   case IK_EVENT_MEMBRANE_REPEAT:
   case IK_EVENT_SWITCH_REPEAT:
     //  error??
@@ -886,6 +1634,7 @@ void Adafruit_IntelliKeys::PostLiftAllModifiers() {
   m_modAlt.SetState(kModifierStateOff);
   m_modControl.SetState(kModifierStateOff);
   m_modCommand.SetState(kModifierStateOff);
+  ReportUpdateModifiers();
 }
 
 void Adafruit_IntelliKeys::PostCPRefresh() {
@@ -902,6 +1651,7 @@ void Adafruit_IntelliKeys::ResetKeyboard(void) {
 void Adafruit_IntelliKeys::ResetMouse(void) {
   //  reset mouse
   m_mouseDown.SetState(kModifierStateOff);
+  ReportUpdateModifiers();
 }
 
 void Adafruit_IntelliKeys::OnStdOverlayChange() {
@@ -951,11 +1701,11 @@ bool Adafruit_IntelliKeys::HasStandardOverlay() {
   return (0 <= m_currentOverlay && m_currentOverlay < 7);
 }
 
-IKOverlay *Adafruit_IntelliKeys::GetCurrentOverlay() {
+IKOverlay const *Adafruit_IntelliKeys::GetCurrentOverlay() {
   if (HasStandardOverlay()) {
     return &stdOverlays[m_currentOverlay];
   } else if ((m_currentOverlay > 7) &&
-             (m_currentOverlay - 8 < _custom_overlay_count) &&
+             ((uint32_t)(m_currentOverlay - 8) < _custom_overlay_count) &&
              (_custom_overlay != NULL)) {
     return &_custom_overlay[m_currentOverlay - 8];
   } else {
@@ -963,52 +1713,53 @@ IKOverlay *Adafruit_IntelliKeys::GetCurrentOverlay() {
   }
 }
 
+// LED animation runs on its own stream, concurrently with tones and requests
 void Adafruit_IntelliKeys::OverlayRecognitionFeedback() {
   // PostMonitorState(false);
 
   int delay = 300;
 
   if (IsSwitchedOn()) {
-    PostSetLED(1, true);
-    PostSetLED(4, true);
-    PostSetLED(7, true);
-    PostDelay(delay);
-    PostSetLED(1, false);
-    PostSetLED(4, false);
-    PostSetLED(7, false);
-
-    PostSetLED(2, true);
-    PostSetLED(5, true);
-    PostSetLED(8, true);
-    PostDelay(delay);
-    PostSetLED(2, false);
-    PostSetLED(5, false);
-    PostSetLED(8, false);
-
-    PostSetLED(3, true);
-    PostSetLED(6, true);
-    PostSetLED(9, true);
-    PostDelay(delay);
-    PostSetLED(3, false);
-    PostSetLED(6, false);
-    PostSetLED(9, false);
+    PostSetLED(1, true, IK_STREAM_FEEDBACK);
+    PostSetLED(4, true, IK_STREAM_FEEDBACK);
+    PostSetLED(7, true, IK_STREAM_FEEDBACK);
+    PostDelay(delay, IK_STREAM_FEEDBACK);
+    PostSetLED(1, false, IK_STREAM_FEEDBACK);
+    PostSetLED(4, false, IK_STREAM_FEEDBACK);
+    PostSetLED(7, false, IK_STREAM_FEEDBACK);
+
+    PostSetLED(2, true, IK_STREAM_FEEDBACK);
+    PostSetLED(5, true, IK_STREAM_FEEDBACK);
+    PostSetLED(8, true, IK_STREAM_FEEDBACK);
+    PostDelay(delay, IK_STREAM_FEEDBACK);
+    PostSetLED(2, false, IK_STREAM_FEEDBACK);
+    PostSetLED(5, false, IK_STREAM_FEEDBACK);
+    PostSetLED(8, false, IK_STREAM_FEEDBACK);
+
+    PostSetLED(3, true, IK_STREAM_FEEDBACK);
+    PostSetLED(6, true, IK_STREAM_FEEDBACK);
+    PostSetLED(9, true, IK_STREAM_FEEDBACK);
+    PostDelay(delay, IK_STREAM_FEEDBACK);
+    PostSetLED(3, false, IK_STREAM_FEEDBACK);
+    PostSetLED(6, false, IK_STREAM_FEEDBACK);
+    PostSetLED(9, false, IK_STREAM_FEEDBACK);
   } else {
     for (int numFlashes = 0; numFlashes < 6; numFlashes++) {
-      PostSetLED(2, true);
-      PostSetLED(5, true);
-      PostSetLED(8, true);
-      PostDelay(delay);
+      PostSetLED(2, true, IK_STREAM_FEEDBACK);
+      PostSetLED(5, true, IK_STREAM_FEEDBACK);
+      PostSetLED(8, true, IK_STREAM_FEEDBACK);
+      PostDelay(delay, IK_STREAM_FEEDBACK);
       // PostLedReconcile();
 
-      PostDelay(delay);
+      PostDelay(delay, IK_STREAM_FEEDBACK);
 
-      PostSetLED(2, false);
-      PostSetLED(5, false);
-      PostSetLED(8, false);
-      PostDelay(delay);
+      PostSetLED(2, false, IK_STREAM_FEEDBACK);
+      PostSetLED(5, false, IK_STREAM_FEEDBACK);
+      PostSetLED(8, false, IK_STREAM_FEEDBACK);
+      PostDelay(delay, IK_STREAM_FEEDBACK);
       // PostLedReconcile();
 
-      PostDelay(delay);
+      PostDelay(delay, IK_STREAM_FEEDBACK);
     }
   }
 
@@ -1022,17 +1773,43 @@ int Adafruit_IntelliKeys::GetLevel() { return m_currentLevel; }
 void Adafruit_IntelliKeys::SetLevel(int level) { m_currentLevel = level; }
 
 void Adafruit_IntelliKeys::SettleOverlay() {
-  uint32_t now = millis();
+  if (m_lastOverlay == m_currentOverlay) {
+    return;
+  }
 
-  //  settle overlay
-  if (m_lastOverlay != m_currentOverlay && now > m_lastOverlayTime + 1000) {
-    m_currentOverlay = m_lastOverlay;
-    IK_PRINTF("Settled on overlay %d\n", m_currentOverlay);
+  uint32_t now = millis();
 
-    SetLevel(1);
+  //  settle overlay once confirmed by stable samples, or unchanged for long
+  bool const confirmed = m_overlayStable >= IK_OVERLAY_STABLE_COUNT;
+  if (!confirmed && now <= m_lastOverlayTime + IK_OVERLAY_SETTLE_TIMEOUT) {
+    return;
+  }
 
-    OnStdOverlayChange();
+  uint32_t const latency = now - m_overlayStart;
+  ik_overlay_stats_t *stats = &m_overlayStats;
+  if (stats->confirmed + stats->timeouts == 0 || latency < stats->min_ms) {
+    stats->min_ms = latency;
+  }
+  if (latency > stats->max_ms) {
+    stats->max_ms = latency;
   }
+  stats->last_ms = latency;
+  stats->total_ms += latency;
+  if (confirmed) {
+    stats->confirmed++;
+  } else {
+    stats->timeouts++;
+  }
+
+  m_currentOverlay = m_lastOverlay;
+  SensorSaveCalibration();
+  IK_PRINTF("Settled on overlay %d in %lu ms (%s)\n", m_currentOverlay,
+            (unsigned long)latency, confirmed ? "stable" : "timeout");
+  ReportRebuild();
+
+  SetLevel(1);
+
+  OnStdOverlayChange();
 }
 
 void Adafruit_IntelliKeys::ShortKeySound() { KeySound(50); }
@@ -1054,7 +1831,7 @@ void Adafruit_IntelliKeys::KeySoundVol(int msLength, int vol) {
   report[1] = 247;
   report[2] = myVol;
   report[3] = msLength / 10;
-  PostCommand(report);
+  PostCommand(report, IK_STREAM_INTERACTIVE);
 }
 
 void Adafruit_IntelliKeys::StoreEEProm(uint8_t data, uint8_t add_lsb,
@@ -1083,6 +1860,7 @@ void Adafruit_IntelliKeys::StoreEEProm(uint8_t data, uint8_t add_lsb,
         m_eepromData.serialnumber[1] == '-') {
       m_bEepromValid = true;
       IK_PRINTF("EEPROM data valid\n");
+      SensorUpdateThresholds();
       PostCPRefresh();
     }
   }
@@ -1101,7 +1879,10 @@ void Adafruit_IntelliKeys::hid_reprot_received_cb(uint8_t daddr, uint8_t idx,
     return;
   }
 
-  ProcessInput(report, len);
+  // only queue the report and re-arm right away, it is decoded by Periodic()
+  if (!tu_fifo_write(&_input_ff, report)) {
+    m_inputOverflow++;
+  }
 
   if (!tuh_hid_receive_report(daddr, idx)) {
     IK_PRINTF("Failed to receive report\n");
@@ -1109,106 +1890,318 @@ void Adafruit_IntelliKeys::hid_reprot_received_cb(uint8_t daddr, uint8_t idx,
   }
 }
 
+void Adafruit_IntelliKeys::hid_report_sent_cb(uint8_t daddr, uint8_t idx,
+                                              uint8_t const *report,
+                                              uint16_t len) {
+  (void)report;
+  (void)len;
+
+  if (daddr != _daddr || idx != 0) {
+    return;
+  }
+
+  ProcessCommands();
+}
+
 //--------------------------------------------------------------------+
 // EZUSB
 //--------------------------------------------------------------------+
 
-// Make an firmware load control request
+// Make an firmware load (upload if direction is IN) control request,
+// completion is handled by ezusb_DownloadTask()
 bool Adafruit_IntelliKeys::ezusb_load_xfer(uint8_t bRequest, uint16_t addr,
-                                           const void *buffer, uint16_t len) {
-  tusb_control_request_t const request = {
+                                           const void *buffer, uint16_t len,
+                                           uint8_t direction) {
+  m_dlRequest = {
       .bmRequestType_bit = {.recipient = TUSB_REQ_RCPT_DEVICE,
                             .type = TUSB_REQ_TYPE_VENDOR,
-                            .direction = TUSB_DIR_OUT},
+                            .direction = direction},
       .bRequest = bRequest,
       .wValue = tu_htole16(addr),
       .wIndex = 0,
       .wLength = tu_htole16(len),
   };
+  m_dlXferBuf = (uint8_t *)buffer;
 
-  tuh_xfer_t xfer = {.daddr = _daddr,
-                     .ep_addr = 0,
-                     .setup = &request,
-                     .buffer = (uint8_t *)buffer,
-                     .complete_cb = NULL,
-                     .user_data = 0};
+  return ezusb_submit();
+}
+
+// Submit m_dlRequest, kept so that it can be sent again if rejected
+bool Adafruit_IntelliKeys::ezusb_submit(void) {
+  // fields not set here e.g result and actual_len are zeroed
+  tuh_xfer_t xfer;
+  memset(&xfer, 0, sizeof(xfer));
+  xfer.daddr = _daddr;
+  xfer.ep_addr = 0;
+  xfer.setup = &m_dlRequest;
+  xfer.buffer = m_dlXferBuf;
+  xfer.complete_cb = ezusb_xfer_complete;
+  xfer.user_data = (uintptr_t)this;
 
   if (!tuh_control_xfer(&xfer)) {
     return false;
   }
 
-  return xfer.result == XFER_RESULT_SUCCESS;
+  m_dlStats.xfer_count++;
+  return true;
+}
+
+// Submit was rejected, control endpoint is busy with another transfer on the
+// bus. Return false once it has been rejected for too long.
+bool Adafruit_IntelliKeys::ezusb_rejected(void) {
+  m_dlBusy = false;
+
+  uint32_t const now = millis();
+  if (!m_dlRejected) {
+    m_dlRejected = true;
+    m_dlRejectTime = now;
+  } else if (now - m_dlRejectTime > IK_EZUSB_SUBMIT_TIMEOUT) {
+    IK_PRINTF("Failed to download firmware, step %u busy\n", m_dlState);
+    m_dlState = IK_DL_FAILED;
+    return false;
+  }
+
+  return true;
 }
 
+void Adafruit_IntelliKeys::ezusb_xfer_complete(tuh_xfer_t *xfer) {
+  Adafruit_IntelliKeys *self = (Adafruit_IntelliKeys *)xfer->user_data;
+
+  if (xfer->daddr != self->_daddr) {
+    return; // device is gone
+  }
+
+  self->m_dlResult = xfer->result;
+  self->m_dlBusy = false;
+}
+
+// Start firmware download, which is then carried out by Periodic()
 bool Adafruit_IntelliKeys::ezusb_StartDevice(void) {
   IK_PRINTF("Downloading firmware\n");
 
-  xfer_result_t result = XFER_RESULT_INVALID;
-  tuh_interface_set(_daddr, 0, 0, NULL, (uintptr_t)&result);
+  memset(&m_dlStats, 0, sizeof(m_dlStats));
+  m_dlStart = micros();
+  m_dlState = IK_DL_SET_INTERFACE;
+  m_dlResult = XFER_RESULT_SUCCESS;
+  m_dlBusy = false;
+  m_dlImage = NULL;
+  m_dlRun.len = 0;
+  m_dlOffset = 0;
+  m_dlChunkLen = 0;
+  m_dlReadBack = false;
+  m_dlRetry = 0;
+  m_dlResubmit = false;
+  m_dlRejected = false;
+
+  ezusb_DownloadTask();
+
+  return m_dlState != IK_DL_FAILED;
+}
 
-  if (result != XFER_RESULT_SUCCESS) {
-    IK_PRINTF("Failed to Set Interface\n");
-    return false;
+// Submit the next download transfer once the previous one completes. The
+// sequence is:
+// - First download loader firmware. The loader firmware implements a vendor
+//   specific command that will allow us to anchor load to external ram
+// - Then download the device firmware and restart the 8051
+//
+// Each image is downloaded in two passes. The first pass loads all of the
+// external addresses, and the 2nd pass loads to all of the internal addresses.
+// why? because downloading to the internal addresses will probably wipe out
+// the firmware running on the device that knows how to receive external ram
+// downloads. Before starting the internal pass, stop the 8051.
+void Adafruit_IntelliKeys::ezusb_DownloadTask(void) {
+  if (m_dlState == IK_DL_IDLE || m_dlState == IK_DL_REENUMERATE ||
+      m_dlState == IK_DL_FAILED || m_dlBusy) {
+    return;
   }
 
-  // First download loader firmware. The loader firmware implements a vendor
-  // specific command that will allow us to anchor load to external ram
-  ezusb_8051Reset(1);
-  ezusb_DownloadIntelHex(ik_loader);
-  ezusb_8051Reset(0);
-
-  // Now download the device firmware
-  ezusb_DownloadIntelHex(ik_firmware);
-  ezusb_8051Reset(1);
-  ezusb_8051Reset(0);
+  if (m_dlResult != XFER_RESULT_SUCCESS) {
+    IK_PRINTF("Failed to download firmware, step %u\n", m_dlState);
+    m_dlState = IK_DL_FAILED;
+    return;
+  }
 
-  IK_PRINTF("Downloaded firmware\n");
+  // image cursor already moved past the rejected transfer: send it as is
+  if (m_dlResubmit) {
+    m_dlBusy = true;
+    if (ezusb_submit()) {
+      m_dlResubmit = false;
+      m_dlRejected = false;
+    } else {
+      ezusb_rejected();
+    }
+    return;
+  }
 
-  return true;
-}
+  while (m_dlState != IK_DL_DONE) {
+    bool image_pass = false;
+    bool ok = false;
+
+    m_dlBusy = true;
+
+    switch (m_dlState) {
+    case IK_DL_SET_INTERFACE:
+      ok = tuh_interface_set(_daddr, 0, 0, ezusb_xfer_complete,
+                             (uintptr_t)this);
+      break;
+
+    case IK_DL_LOADER_HALT:
+    case IK_DL_LOADER_INTERNAL_HALT:
+    case IK_DL_FIRMWARE_INTERNAL_HALT:
+    case IK_DL_FIRMWARE_HALT:
+      ok = ezusb_8051Reset(1);
+      break;
+
+    case IK_DL_LOADER_RUN:
+    case IK_DL_FIRMWARE_RUN:
+      ok = ezusb_8051Reset(0);
+      break;
+
+    case IK_DL_LOADER_EXTERNAL:
+    case IK_DL_LOADER_INTERNAL:
+    case IK_DL_FIRMWARE_EXTERNAL:
+    case IK_DL_FIRMWARE_INTERNAL: {
+      bool const internal_ram = (m_dlState == IK_DL_LOADER_INTERNAL ||
+                                 m_dlState == IK_DL_FIRMWARE_INTERNAL);
+      image_pass = true;
+
+      if (!ezusb_imageXfer(internal_ram, &ok)) {
+        // pass complete
+        m_dlBusy = false;
+        m_dlImage = NULL;
+        m_dlState++;
+        continue;
+      }
+      break;
+    }
 
-bool Adafruit_IntelliKeys::ezusb_DownloadIntelHex(
-    INTEL_HEX_RECORD const *hex_record) {
-  // The download must be performed in two passes.  The first pass loads all of
-  // the external addresses, and the 2nd pass loads to all of the internal
-  // addresses. why?  because downloading to the internal addresses will
-  // probably wipe out the firmware running on the device that knows how to
-  // receive external ram downloads.
+    default:
+      break;
+    }
 
-  // First download all the records that go in external ram
-  ezusb_downloadHex(hex_record, false);
+    if (m_dlState == IK_DL_FAILED) {
+      m_dlBusy = false; // verify gave up
+      return;
+    }
 
-  // Now download all of the records that are in internal RAM.  Before starting
-  // the download, stop the 8051.
-  ezusb_8051Reset(1);
+    // other steps are simply run again
+    if (!ok) {
+      bool const retry = ezusb_rejected();
+      m_dlResubmit = image_pass && retry;
+      return;
+    }
+    m_dlRejected = false;
 
-  ezusb_downloadHex(hex_record, true);
+    if (!image_pass) {
+      m_dlState++;
+    }
+    return;
+  }
 
-  return false;
+  m_dlStats.total_us = micros() - m_dlStart;
+  m_dlState = IK_DL_REENUMERATE;
+  IK_PRINTF("Downloaded firmware in %lu us (verify %lu us, %u retries)\n",
+            (unsigned long)m_dlStats.total_us,
+            (unsigned long)m_dlStats.verify_us, m_dlStats.retry_count);
 }
 
-bool Adafruit_IntelliKeys::ezusb_downloadHex(INTEL_HEX_RECORD const *ptr,
-                                             bool internal_ram) {
-  // First download all the records that go in external ram
-  while (ptr->Type == 0) {
-    if (INTERNAL_RAM(ptr->Address) == internal_ram) {
-      // IK_PRINTF("Downloading %d uint8_ts to 0x%x\n", ptr->Length,
-      // ptr->Address);
+// Submit the next transfer of an image pass: write the next chunk, or with
+// IK_EZUSB_VERIFY, read back the chunk just written and write it again if
+// its CRC does not match. Return false when the pass is complete.
+bool Adafruit_IntelliKeys::ezusb_imageXfer(bool internal_ram, bool *ok) {
+  uint8_t const bRequest =
+      internal_ram ? ANCHOR_LOAD_INTERNAL : ANCHOR_LOAD_EXTERNAL;
+
+#if IK_EZUSB_VERIFY
+  if (m_dlChunkLen && !m_dlReadBack) {
+    m_dlReadBack = true;
+    m_dlReadStart = micros();
+    m_dlStats.verify_count++;
+    *ok = ezusb_load_xfer(bRequest, m_dlRun.addr + m_dlOffset, m_dlBuf,
+                          m_dlChunkLen, TUSB_DIR_IN);
+    return true;
+  }
 
-      uint8_t const bRequest =
-          internal_ram ? ANCHOR_LOAD_INTERNAL : ANCHOR_LOAD_EXTERNAL;
-      if (!ezusb_load_xfer(bRequest, ptr->Address, ptr->Data, ptr->Length)) {
-        IK_PRINTF("Failed to load hex file");
-        return false;
-      }
+  if (m_dlReadBack) {
+    m_dlReadBack = false;
+    bool const match = ik_ezusb_crc32(m_dlBuf, m_dlChunkLen) == m_dlChunkCrc;
+    m_dlStats.verify_us += micros() - m_dlReadStart;
+
+    if (match) {
+      m_dlOffset += m_dlChunkLen;
+      m_dlChunkLen = 0;
+      m_dlRetry = 0;
+    } else if (m_dlRetry < IK_EZUSB_VERIFY_RETRIES) {
+      IK_PRINTF("Verify failed at 0x%04x, retry\n",
+                m_dlRun.addr + m_dlOffset);
+      m_dlRetry++;
+      m_dlStats.retry_count++;
+    } else {
+      IK_PRINTF("Verify failed at 0x%04x\n", m_dlRun.addr + m_dlOffset);
+      m_dlState = IK_DL_FAILED;
+      *ok = false;
+      return true;
     }
+  }
+#else
+  if (m_dlChunkLen) {
+    m_dlOffset += m_dlChunkLen;
+    m_dlChunkLen = 0;
+  }
+#endif
 
-    ptr++;
+  if (m_dlChunkLen == 0) {
+    if (m_dlOffset >= m_dlRun.len && !ezusb_nextRun(internal_ram)) {
+      return false;
+    }
+
+    m_dlChunkLen = tu_min16(m_dlRun.len - m_dlOffset, IK_EZUSB_MAX_XFER);
+#if IK_EZUSB_COMPRESS
+    m_dlChunkSrc = m_dlRun.data; // tokens of next chunk
+#else
+    m_dlChunkSrc = m_dlRun.data + m_dlOffset;
+#endif
   }
 
+#if IK_EZUSB_COMPRESS
+  // decompress chunk, run data then points to tokens of the following chunk
+  m_dlRun.data = m_dlChunkSrc;
+  ik_ezusb_lz_decode(&m_dlRun.data, m_dlBuf, m_dlChunkLen);
+  uint8_t const *data = m_dlBuf;
+#else
+  // runs are contiguous in flash, sent in place
+  uint8_t const *data = m_dlChunkSrc;
+#endif
+
+#if IK_EZUSB_VERIFY
+  m_dlChunkCrc = ik_ezusb_crc32(data, m_dlChunkLen);
+#endif
+
+  uint16_t const addr = m_dlRun.addr + m_dlOffset;
+
+  // IK_PRINTF("Downloading %d uint8_ts to 0x%x\n", m_dlChunkLen, addr);
+  *ok = ezusb_load_xfer(bRequest, addr, data, m_dlChunkLen);
   return true;
 }
 
+// Move to the next run of current image that goes to the requested ram
+bool Adafruit_IntelliKeys::ezusb_nextRun(bool internal_ram) {
+  if (m_dlImage == NULL) {
+    m_dlImage = (m_dlState < IK_DL_LOADER_RUN) ? ik_loader_image.data
+                                                : ik_firmware_image.data;
+  }
+
+  while (ik_ezusb_next_run(&m_dlImage, &m_dlRun, IK_EZUSB_COMPRESS)) {
+    if (INTERNAL_RAM(m_dlRun.addr) == internal_ram) {
+      m_dlOffset = 0;
+      return true;
+    }
+  }
+
+  return false;
+}
+
 bool Adafruit_IntelliKeys::ezusb_8051Reset(uint8_t resetBit) {
-  return ezusb_load_xfer(ANCHOR_LOAD_INTERNAL, CPUCS_REG, &resetBit, 1);
+  m_dlCpucs = resetBit;
+  return ezusb_load_xfer(ANCHOR_LOAD_INTERNAL, CPUCS_REG, &m_dlCpucs, 1);
 }
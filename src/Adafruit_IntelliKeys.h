@@ -25,19 +25,199 @@
 #ifndef ADAFRUIT_INTELLIKEYS_H_
 #define ADAFRUIT_INTELLIKEYS_H_
 
+#include <atomic>
+
 #include "Adafruit_TinyUSB.h"
 #include "intellikeysdefs.h"
 
 #include "IKModifier.h"
 #include "IKOverlay.h"
+#include "IKSensor.h"
 #include "IKUniversal.h"
+#include "ik_ezusb_image.h"
+#include "ik_spsc_ring.h"
 
 //  maximum numbers
 #define MAX_INTELLIKEYS 10
 #define MAX_STANDARD_OVERLAYS 8
 #define MAX_SWITCH_OVERLAYS 30
 
-#define IK_CMD_FIFO_SIZE 128
+// Depth of each command stream, a full stream only rejects its own commands
+#define IK_CMD_FIFO_SIZE 128 // background
+#define IK_INTERACTIVE_FIFO_SIZE 32
+#define IK_FEEDBACK_FIFO_SIZE 96
+
+// Number of input reports queued by the receive callback until Periodic()
+// decodes them, a report received while the queue is full is dropped
+#ifndef IK_INPUT_FIFO_SIZE
+#define IK_INPUT_FIFO_SIZE 32
+#endif
+
+// Device commands are queued in streams. Each stream is an independent
+// timeline: IK_CMD_DELAY only holds back later commands of the same stream,
+// so that LED animations run concurrently with tones and device requests.
+// Streams are also priority classes: a lower stream is only served when all
+// higher streams are empty or on hold.
+enum {
+  IK_STREAM_INTERACTIVE = 0, // key tones, LED state
+  IK_STREAM_FEEDBACK,        // sound and LED animations
+  IK_STREAM_BACKGROUND,      // init, correction, eeprom and other requests
+  IK_STREAM_COUNT
+};
+
+typedef struct {
+  tu_fifo_t ff;
+  uint32_t delay_until; // stream is on hold until this time
+} ik_cmd_stream_t;
+
+// when at least this many LEDs change at once, a single IK_CMD_ALL_LEDS is
+// sent instead of one IK_CMD_LED per LED. 0 to always use IK_CMD_LED, which
+// is the default since the IK_CMD_ALL_LEDS payload is not verified on hardware
+#ifndef IK_LED_BATCH_THRESHOLD
+#define IK_LED_BATCH_THRESHOLD 0
+#endif
+
+// maximum number of membrane cells tracked in the pressed list, if more cells
+// are pressed at once, report generation falls back to scanning the bitset
+#ifndef IK_MAX_PRESSED_CELLS
+#define IK_MAX_PRESSED_CELLS 32
+#endif
+
+// Event mode set by IK_CMD_INIT on Start(). In IK_EVENT_MODE_AUTO the device
+// sends each event in its own interrupt report as soon as it occurs. In
+// IK_EVENT_MODE_POLLED it holds events until asked: Periodic() sends
+// IK_CMD_GET_EVENT every IK_EVENT_POLL_INTERVAL ms and asks again after each
+// event until IK_EVENT_NOMOREEVENTS, draining the device queue in batches.
+#ifndef IK_EVENT_MODE
+#define IK_EVENT_MODE IK_EVENT_MODE_AUTO
+#endif
+
+#ifndef IK_EVENT_POLL_INTERVAL
+#define IK_EVENT_POLL_INTERVAL 8
+#endif
+
+// A poll without reply for this long (ms) is abandoned and sent again
+#ifndef IK_EVENT_POLL_TIMEOUT
+#define IK_EVENT_POLL_TIMEOUT 100
+#endif
+
+// A new overlay is recognized once IK_OVERLAY_STABLE_COUNT sensor samples in
+// a row agree on it with every sensor outside its hysteresis band, or as a
+// fallback once it has not changed for IK_OVERLAY_SETTLE_TIMEOUT ms
+#ifndef IK_OVERLAY_STABLE_COUNT
+#define IK_OVERLAY_STABLE_COUNT 10
+#endif
+
+#ifndef IK_OVERLAY_SETTLE_TIMEOUT
+#define IK_OVERLAY_SETTLE_TIMEOUT 1000
+#endif
+
+// Sensor calibration refined online is kept in RAM for this many devices by
+// serial number, and restored when one is plugged again. It only lasts for
+// the session: it is not written back to the device EEPROM nor to flash, and
+// starts over from the EEPROM calibration after the host is reset.
+#ifndef IK_SENSOR_CAL_SLOTS
+#define IK_SENSOR_CAL_SLOTS 4
+#endif
+
+// Depth of the HID report event ring between the USB host core (producer) and
+// the core calling getHIDReport() (consumer), must be a power of 2
+#ifndef IK_HID_EVENT_DEPTH
+#define IK_HID_EVENT_DEPTH 16
+#endif
+
+// Firmware download steps, one control transfer each except for image passes
+// which take one transfer per run chunk. External ram is loaded first since
+// it needs the loader running, see ezusb_DownloadTask()
+enum {
+  IK_DL_IDLE = 0,
+  IK_DL_SET_INTERFACE,
+  IK_DL_LOADER_HALT,
+  IK_DL_LOADER_EXTERNAL,
+  IK_DL_LOADER_INTERNAL_HALT,
+  IK_DL_LOADER_INTERNAL,
+  IK_DL_LOADER_RUN,
+  IK_DL_FIRMWARE_EXTERNAL,
+  IK_DL_FIRMWARE_INTERNAL_HALT,
+  IK_DL_FIRMWARE_INTERNAL,
+  IK_DL_FIRMWARE_HALT,
+  IK_DL_FIRMWARE_RUN,
+  IK_DL_DONE,
+  IK_DL_REENUMERATE, // firmware runs, until the device drops off
+  IK_DL_FAILED
+};
+
+// Read back each downloaded chunk and compare its CRC32, a chunk that does
+// not match is written again up to IK_EZUSB_VERIFY_RETRIES times
+#ifndef IK_EZUSB_VERIFY
+#define IK_EZUSB_VERIFY 0
+#endif
+
+#ifndef IK_EZUSB_VERIFY_RETRIES
+#define IK_EZUSB_VERIFY_RETRIES 3
+#endif
+
+// A download transfer rejected because the control endpoint is busy (hub
+// request, another device downloading) is submitted again on each Periodic(),
+// the download only fails if it is still rejected after this many ms
+#ifndef IK_EZUSB_SUBMIT_TIMEOUT
+#define IK_EZUSB_SUBMIT_TIMEOUT 1000
+#endif
+
+// Firmware version reported by the bundled ik_firmware. A device that mounts
+// already running another version gets our firmware downloaded again. 0.0 is
+// unknown: any running firmware is accepted, until a device downloaded by us
+// reports its version, which is then expected from warm devices.
+#ifndef IK_FIRMWARE_VERSION_MAJOR
+#define IK_FIRMWARE_VERSION_MAJOR 0
+#endif
+
+#ifndef IK_FIRMWARE_VERSION_MINOR
+#define IK_FIRMWARE_VERSION_MINOR 0
+#endif
+
+// Time from mount to the firmware version report of the device
+typedef struct {
+  uint32_t cold_us;    // last cold start: firmware download and re-enumeration
+  uint32_t warm_us;    // last warm start: device already running our firmware
+  uint16_t cold_count; // number of cold starts
+  uint16_t warm_count; // number of warm starts
+} ik_startup_stats_t;
+
+typedef struct {
+  uint32_t total_us;     // time to ready, including verification
+  uint32_t verify_us;    // time spent reading back and comparing
+  uint16_t xfer_count;   // firmware load/upload transfers
+  uint16_t verify_count; // read-back transfers
+  uint16_t retry_count;  // chunks written again after a mismatch
+} ik_download_stats_t;
+
+// Polled event mode counters, kept across re-enumeration
+typedef struct {
+  uint32_t polls;     // IK_CMD_GET_EVENT sent
+  uint32_t events;    // events received in reply to a poll
+  uint32_t batches;   // polls answered by IK_EVENT_NOMOREEVENTS
+  uint16_t max_batch; // most events drained by one batch
+  uint16_t timeouts;  // polls abandoned without reply
+} ik_event_stats_t;
+
+// Overlay recognition latency, from the first sensor change away from the
+// current overlay until the new one is settled, kept across re-enumeration
+typedef struct {
+  uint32_t last_ms;
+  uint32_t min_ms;
+  uint32_t max_ms;
+  uint32_t total_ms;  // sum of all, average is total / (confirmed + timeouts)
+  uint16_t confirmed; // recognized by stable samples
+  uint16_t timeouts;  // recognized by IK_OVERLAY_SETTLE_TIMEOUT
+} ik_overlay_stats_t;
+
+// Keyboard and mouse report published by the USB host core on every change
+typedef struct {
+  uint32_t seq;
+  hid_keyboard_report_t kb;
+  hid_mouse_report_t mouse;
+} ik_hid_event_t;
 
 class Adafruit_IntelliKeys {
 public:
@@ -55,44 +235,105 @@ public:
   bool mount(uint8_t daddr);
   void umount(uint8_t daddr);
 
-  void setCustomOverlay(IKOverlay *overlay, uint32_t count) {
+  void setCustomOverlay(IKOverlay const *overlay, uint32_t count) {
     _custom_overlay = overlay;
     _custom_overlay_count = count;
   }
 
-  void getHIDReport(hid_keyboard_report_t *kb_report,
-                    hid_mouse_report_t *mouse_report);
+  // Get keyboard and mouse report. Return the report sequence number, which
+  // changes whenever report content changes. Note mouse x/y should be sent on
+  // every poll while non-zero since it is a movement.
+  // Reports are consumed in order from an event ring filled by the USB host
+  // side, one per call, so this can be called from another core than
+  // Periodic() and the host callbacks, and quick taps are not lost.
+  uint32_t getHIDReport(hid_keyboard_report_t *kb_report,
+                        hid_mouse_report_t *mouse_report);
+
+  // Sequence number of the report last returned by getHIDReport(), consumer
+  // side only: it does not read state of the USB host side
+  uint32_t getHIDReportSeq(void) { return m_hidLast.seq; }
+
+  // Number of times the event ring was full, the latest report is then
+  // published as soon as there is room again
+  uint32_t getHIDEventOverflow(void) { return m_hidOverflow; }
+
+  // Number of input reports dropped because the input queue was full
+  uint32_t getInputOverflow(void) { return m_inputOverflow; }
+
+  // Select IK_EVENT_MODE_AUTO or IK_EVENT_MODE_POLLED with its poll interval
+  // in ms, applied to the device on next Start() i.e mount
+  void setEventMode(uint8_t mode,
+                    uint16_t poll_interval = IK_EVENT_POLL_INTERVAL) {
+    m_eventMode = mode;
+    m_pollInterval = poll_interval;
+  }
+  uint8_t getEventMode(void) { return m_eventMode; }
+  ik_event_stats_t const *getEventStats(void) { return &m_eventStats; }
+
+  // Sample counters of overlay sensor 0..IK_NUM_SENSORS-1, NULL if invalid
+  ik_sensor_stats_t const *getSensorStats(uint8_t sensor) {
+    return sensor < IK_NUM_SENSORS ? m_sensors[sensor].GetStats() : NULL;
+  }
+  ik_overlay_stats_t const *getOverlayStats(void) { return &m_overlayStats; }
+
+  // Current threshold of overlay sensor, -1 if invalid
+  int getSensorThreshold(uint8_t sensor) {
+    return sensor < IK_NUM_SENSORS ? m_sensors[sensor].GetThreshold() : -1;
+  }
+
+  // Time taken by the last firmware download in microseconds
+  uint32_t getDownloadTime(void) { return m_dlStats.total_us; }
+  ik_download_stats_t const *getDownloadStats(void) { return &m_dlStats; }
+  ik_startup_stats_t const *getStartupStats(void) { return &m_startupStats; }
   void Periodic(void);
 
   void onMemBraneChanged(membrane_callback_t func) { _membrane_cb = func; }
   void onSwitchChanged(switch_callback_t func) { _switch_cb = func; }
   void onToggleChanged(toggle_callback_t func) { _toggle_cb = func; }
 
-  uint8_t const (*getMembrane(void))[IK_RESOLUTION_Y] { return m_membrane; }
+  // Copy membrane state, one word per row with bit n set if column n is
+  // pressed. The copy is coherent and can be taken from another core than
+  // the host callbacks without lock: it is read from a double-buffered
+  // snapshot and only retried if the host side published twice meanwhile.
+  // Return the snapshot number, which changes on every membrane change.
+  uint32_t getMembrane(uint32_t membrane[IK_RESOLUTION_Y]);
+  bool isMembranePressed(uint8_t row, uint8_t col);
 
   //--------------------------------------------------------------------+
   // Function named following IKDevice in OpenIKeys
   //--------------------------------------------------------------------+
 
   bool isAttached(void) { return _daddr != 0; }
+  uint8_t getDeviceAddress(void) { return _daddr; }
+  bool IsStartPending(void) { return m_startupPending; }
   bool IsOpen(void) { return _opened; }
   bool IsSwitchedOn(void) { return m_toggle == 1; }
   bool IsNumLockOn(void);
   bool IsCapsLockOn(void);
   bool IsMouseDown(void);
 
-  bool PostCommand(uint8_t *command);
-  void PostDelay(uint8_t msec);
-  void PostSetLED(uint8_t number, uint8_t value);
+  bool PostCommand(uint8_t *command, uint8_t stream = IK_STREAM_BACKGROUND);
+  void PostDelay(uint16_t msec, uint8_t stream = IK_STREAM_BACKGROUND);
+  void PostSetLED(uint8_t number, uint8_t value,
+                  uint8_t stream = IK_STREAM_INTERACTIVE);
+  void PostSetLEDs(uint16_t leds, uint8_t stream = IK_STREAM_INTERACTIVE);
   void PostKey(int code, int direction, int delayAfter = 0);
   void PostLiftAllModifiers(void);
   void PostCPRefresh();
-  void PostReportDataToControlPanel(bool bForce = false);
+  void PostReportDataToControlPanel(void);
   void ProcessCommands();
+  void ProcessInputQueue(void);
+  void PollEvents(uint32_t now);
+  void PostGetEvent(void);
+  void OnPolledEvent(uint8_t event_id);
 
   void OnToggle(int newValue);
   void OnSwitch(int nswitch, int state);
   void OnSensorChange(int sensor, int value);
+  void SensorTick(uint32_t now);
+  void SensorUpdateThresholds(void);
+  void SensorRestoreCalibration(void);
+  void SensorSaveCalibration(void);
   void StoreEEProm(uint8_t data, uint8_t add_lsb, uint8_t add_msb);
   void ProcessInput(uint8_t const *data, uint8_t len);
 
@@ -113,7 +354,7 @@ public:
   void SetLevel(int level);
   int GetCurrentOverlayNumber() { return m_currentOverlay; }
   bool HasStandardOverlay();
-  IKOverlay *GetCurrentOverlay();
+  IKOverlay const *GetCurrentOverlay();
   void SettleOverlay();
   void OnStdOverlayChange();
   void OverlayRecognitionFeedback();
@@ -128,6 +369,10 @@ public:
   void hid_reprot_received_cb(uint8_t dev_addr, uint8_t instance,
                               uint8_t const *report, uint16_t len);
 
+  // Should be called from tuh_hid_report_sent_cb(), chain next command
+  void hid_report_sent_cb(uint8_t dev_addr, uint8_t instance,
+                          uint8_t const *report, uint16_t len);
+
 private:
   uint8_t _daddr;
   uint8_t _opened;
@@ -136,7 +381,7 @@ private:
   switch_callback_t _switch_cb;
   toggle_callback_t _toggle_cb;
 
-  IKOverlay *_custom_overlay;
+  IKOverlay const *_custom_overlay;
   uint32_t _custom_overlay_count;
 
   //------------- From OpenIKeys -------------//
@@ -145,11 +390,16 @@ private:
   int m_newLevel;
 
   uint32_t m_lastLEDTime;
-  uint32_t m_delayUntil;
+
+  // LED shadow: state of LED n at bit (n-1) once its command is queued
+  uint16_t m_ledState;
+  uint16_t m_ledKnown;
   uint32_t m_nextCorrect;
 
   int m_toggle; // on/off switch
-  int m_sensors[IK_NUM_SENSORS];
+  IKSensor m_sensors[IK_NUM_SENSORS];
+  uint32_t m_nextSensorTick;
+  int8_t m_calSlot; // calibration slot of last device, kept across Reset()
 
   int m_lastSwitch;
 
@@ -157,6 +407,9 @@ private:
   int m_lastOverlay;
   uint32_t m_lastOverlayTime;
   int m_currentOverlay;
+  uint16_t m_overlayStable; // confident samples agreeing on m_lastOverlay
+  uint32_t m_overlayStart;  // m_lastOverlay first left m_currentOverlay
+  ik_overlay_stats_t m_overlayStats;
 
   //  reading the eeprom
   eeprom_t m_eepromData;
@@ -164,19 +417,80 @@ private:
   bool m_eepromDataValid[sizeof(eeprom_t)];
   bool m_bEepromValid;
 
+  //  membrane is stored as bitset: one word per row, bit n is column n
   //  for correction
-  uint8_t m_membranePressedInCorrectMode[IK_RESOLUTION_X][IK_RESOLUTION_Y];
+  uint32_t m_membranePressedInCorrectMode[IK_RESOLUTION_Y];
   uint8_t m_switchesPressedInCorrectMode[IK_NUM_SWITCHES];
 
-  uint8_t m_last_membrane[IK_RESOLUTION_X][IK_RESOLUTION_Y];
+  uint32_t m_last_membrane[IK_RESOLUTION_Y];
   uint8_t m_last_switches[IK_NUM_SWITCHES];
 
-  uint8_t m_membrane[IK_RESOLUTION_X][IK_RESOLUTION_Y];
+  uint32_t m_membrane[IK_RESOLUTION_Y];
   uint8_t m_switches[IK_NUM_SWITCHES];
 
+  //  membrane snapshot for getMembrane(): publish n goes to buffer n & 1,
+  //  sequence is 2n when published and odd while the next one is written
+  std::atomic<uint32_t> m_membraneSnap[2][IK_RESOLUTION_Y];
+  std::atomic<uint32_t> m_membraneSeq;
+
+  //  pressed cells in press order, so that report only visits pressed cells
+  struct {
+    uint8_t row;
+    uint8_t col;
+  } m_pressed[IK_MAX_PRESSED_CELLS];
+  uint8_t m_pressedCount;
+  bool m_pressedOverflow;
+
+  //  HID report maintained incrementally by membrane events
+  hid_keyboard_report_t m_kbReport;
+  hid_mouse_report_t m_mouseReport;
+  uint8_t m_cellModifier; // modifiers from pressed cells
+  uint8_t m_cellButtons;  // mouse buttons from pressed cells
+  uint32_t m_reportSeq;
+
+  //  reports from USB host side to getHIDReport() side, and the consumer's
+  //  copy of the last popped report, only touched by getHIDReport()
+  IKSpscRing<ik_hid_event_t, IK_HID_EVENT_DEPTH> m_hidRing;
+  ik_hid_event_t m_hidLast;
+  bool m_hidPending; // ring was full, latest report not published yet
+  uint32_t m_hidOverflow;
+
   uint8_t m_firmwareVersionMajor;
   uint8_t m_firmwareVersionMinor;
 
+  //  startup timing, kept across re-enumeration
+  ik_startup_stats_t m_startupStats;
+  uint32_t m_startupBegin;
+  bool m_startupPending; // waiting for firmware version
+  bool m_startupCold;    // firmware was downloaded
+
+  //  firmware download, advanced by Periodic()
+  ik_download_stats_t m_dlStats; // kept across re-enumeration
+  uint8_t m_dlState;
+  uint8_t m_dlResult; // result of last transfer
+  bool m_dlBusy;      // transfer in flight
+  uint8_t m_dlCpucs;  // 8051 reset transfer buffer
+  uint8_t const *m_dlImage;
+  ik_ezusb_run_t m_dlRun; // current run of image pass
+  uint16_t m_dlOffset;    // bytes of current run already sent
+  uint16_t m_dlChunkLen;  // chunk being written, 0 if none
+  uint8_t const *m_dlChunkSrc; // chunk data, or tokens if compressed
+  uint32_t m_dlStart;
+#if IK_EZUSB_VERIFY
+  uint32_t m_dlChunkCrc;
+  uint32_t m_dlReadStart;
+#endif
+  bool m_dlReadBack; // read-back of current chunk in flight
+  uint8_t m_dlRetry;
+  tusb_control_request_t m_dlRequest; // last image pass transfer
+  uint8_t *m_dlXferBuf;
+  bool m_dlResubmit;       // m_dlRequest was rejected, send it again
+  bool m_dlRejected;       // last submit was rejected
+  uint32_t m_dlRejectTime; // first rejected submit
+#if IK_EZUSB_COMPRESS || IK_EZUSB_VERIFY
+  uint8_t m_dlBuf[IK_EZUSB_MAX_XFER]; // decompressed or read-back chunk
+#endif
+
   int m_lastCodeUp;
   bool m_bShifted;
 
@@ -187,22 +501,63 @@ private:
 
   IKModifier m_mouseDown;
 
-  tu_fifo_t _cmd_ff;
+  ik_cmd_stream_t _streams[IK_STREAM_COUNT];
+  OSAL_MUTEX_DEF(_interactive_ff_mutex);
+  OSAL_MUTEX_DEF(_feedback_ff_mutex);
   OSAL_MUTEX_DEF(_cmd_ff_mutex);
+  uint8_t _interactive_ff_buf[8 * IK_INTERACTIVE_FIFO_SIZE];
+  uint8_t _feedback_ff_buf[8 * IK_FEEDBACK_FIFO_SIZE];
   uint8_t _cmd_ff_buf[8 * IK_CMD_FIFO_SIZE];
 
+  //  polled event mode
+  ik_event_stats_t m_eventStats;
+  uint8_t m_eventMode;
+  bool m_pollBusy;         // waiting for reply of IK_CMD_GET_EVENT
+  uint16_t m_pollInterval; // ms between batches
+  uint16_t m_pollBatch;    // events of current batch
+  uint32_t m_pollTime;     // IK_CMD_GET_EVENT sent
+  uint32_t m_nextPoll;
+
+  //  input reports from the receive callback, decoded by Periodic()
+  tu_fifo_t _input_ff;
+  uint8_t _input_ff_buf[IK_REPORT_LEN * IK_INPUT_FIFO_SIZE];
+  uint32_t m_inputOverflow;
+
+  bool ProcessStream(uint8_t stream, uint32_t now);
+
   bool Start(void);
   void Reset(void);
+  void OnFirmwareVersion(uint8_t major, uint8_t minor);
+
+  void PressedListAdd(uint8_t row, uint8_t col);
+  void PressedListRemove(uint8_t row, uint8_t col);
+  void PressedListRebuild(void);
+  void MembranePublish(void);
+
+  bool ReportIsActive(void);
+  uint8_t ReportLatchedModifier(void);
+  void ReportAddCell(IKOverlay const *overlay, uint8_t row, uint8_t col);
+  void ReportCommit(hid_keyboard_report_t const *kb_prev,
+                    hid_mouse_report_t const *mouse_prev);
+  void ReportPublish(void);
+  void ReportCellPressed(uint8_t row, uint8_t col);
+  void ReportCellReleased(uint8_t row, uint8_t col);
+  void ReportUpdateModifiers(void);
+  void ReportRebuild(void);
 
   // ezusb
   bool ezusb_StartDevice(void);
-  bool ezusb_DownloadIntelHex(INTEL_HEX_RECORD const *record);
+  void ezusb_DownloadTask(void);
   bool ezusb_8051Reset(uint8_t resetBit);
 
   // internal helper
   bool ezusb_load_xfer(uint8_t brequest, uint16_t addr, const void *buffer,
-                       uint16_t len);
-  bool ezusb_downloadHex(INTEL_HEX_RECORD const *record, bool internal_ram);
+                       uint16_t len, uint8_t direction = TUSB_DIR_OUT);
+  bool ezusb_submit(void);
+  bool ezusb_rejected(void);
+  bool ezusb_imageXfer(bool internal_ram, bool *ok);
+  bool ezusb_nextRun(bool internal_ram);
+  static void ezusb_xfer_complete(tuh_xfer_t *xfer);
 };
 
 #endif
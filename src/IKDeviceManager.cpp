@@ -0,0 +1,203 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "Arduino.h"
+
+#include "IKDeviceManager.h"
+
+static_assert(IK_MAX_DEVICES <= 8, "contributing mask is 8-bit");
+
+IKDeviceManager::IKDeviceManager(void) {
+  _contrib_mask = 0;
+  memset(_dev_seq, 0, sizeof(_dev_seq));
+  _seq = 0;
+}
+
+void IKDeviceManager::begin(void) {
+  for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+    _devices[i].begin();
+  }
+}
+
+Adafruit_IntelliKeys *IKDeviceManager::getDevice(uint8_t daddr) {
+  for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+    if (_devices[i].getDeviceAddress() == daddr) {
+      return &_devices[i];
+    }
+  }
+  return NULL;
+}
+
+uint8_t IKDeviceManager::getDeviceCount(void) {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+    count += _devices[i].isAttached() ? 1 : 0;
+  }
+  return count;
+}
+
+bool IKDeviceManager::mount(uint8_t daddr) {
+  // device re-enumerates after firmware download, prefer the slot that
+  // downloaded it to keep its startup timing
+  Adafruit_IntelliKeys *dev = getDevice(0);
+  for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+    if (!_devices[i].isAttached() && _devices[i].IsStartPending()) {
+      dev = &_devices[i];
+      break;
+    }
+  }
+
+  if (dev == NULL) {
+    return false; // all slots in use, increase IK_MAX_DEVICES
+  }
+
+  if (!dev->mount(daddr)) {
+    dev->umount(daddr);
+    return false;
+  }
+
+  return true;
+}
+
+void IKDeviceManager::umount(uint8_t daddr) {
+  Adafruit_IntelliKeys *dev = getDevice(daddr);
+  if (dev) {
+    dev->umount(daddr);
+  }
+}
+
+void IKDeviceManager::Periodic(void) {
+  for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+    _devices[i].Periodic();
+  }
+}
+
+void IKDeviceManager::setCustomOverlay(IKOverlay const *overlay,
+                                       uint32_t count) {
+  for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+    _devices[i].setCustomOverlay(overlay, count);
+  }
+}
+
+void IKDeviceManager::hid_reprot_received_cb(uint8_t daddr, uint8_t idx,
+                                             uint8_t const *report,
+                                             uint16_t len) {
+  Adafruit_IntelliKeys *dev = getDevice(daddr);
+  if (dev) {
+    dev->hid_reprot_received_cb(daddr, idx, report, len);
+  }
+}
+
+void IKDeviceManager::hid_report_sent_cb(uint8_t daddr, uint8_t idx,
+                                         uint8_t const *report, uint16_t len) {
+  Adafruit_IntelliKeys *dev = getDevice(daddr);
+  if (dev) {
+    dev->hid_report_sent_cb(daddr, idx, report, len);
+  }
+}
+
+bool IKDeviceManager::isAttached(void) { return getDeviceCount() > 0; }
+
+bool IKDeviceManager::IsOpen(void) {
+  for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+    if (_devices[i].IsOpen()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool IKDeviceManager::IsSwitchedOn(void) {
+  for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+    if (_devices[i].IsOpen() && _devices[i].IsSwitchedOn()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void mergeKeyboard(hid_keyboard_report_t *merged,
+                          hid_keyboard_report_t const *report) {
+  merged->modifier |= report->modifier;
+
+  for (uint8_t i = 0; i < 6 && report->keycode[i]; i++) {
+    for (uint8_t j = 0; j < 6; j++) {
+      if (merged->keycode[j] == report->keycode[i]) {
+        break; // already in report
+      }
+      if (merged->keycode[j] == 0) {
+        merged->keycode[j] = report->keycode[i];
+        break;
+      }
+    }
+  }
+}
+
+static int8_t addMouseMovement(int8_t a, int8_t b) {
+  int16_t const sum = (int16_t)a + b;
+  return (int8_t)(sum > 127 ? 127 : (sum < -127 ? -127 : sum));
+}
+
+uint32_t IKDeviceManager::getHIDReport(hid_keyboard_report_t *kb_report,
+                                       hid_mouse_report_t *mouse_report) {
+  memset(kb_report, 0, sizeof(hid_keyboard_report_t));
+  memset(mouse_report, 0, sizeof(hid_mouse_report_t));
+
+  uint8_t mask = 0;
+  bool changed = false;
+
+  for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+    Adafruit_IntelliKeys *dev = &_devices[i];
+
+    // consume reports of inactive or detached devices as well, so that stale
+    // ones are not replayed when the device is switched on or attached again
+    hid_keyboard_report_t kb;
+    hid_mouse_report_t mouse;
+    uint32_t const dev_seq = dev->getHIDReport(&kb, &mouse);
+    if (!dev->IsOpen() || !dev->IsSwitchedOn()) {
+      continue;
+    }
+
+    // sequences of different devices can not be summed, changes would
+    // cancel out: compare each one with its last value instead
+    changed = changed || (dev_seq != _dev_seq[i]);
+    _dev_seq[i] = dev_seq;
+    mask |= (uint8_t)(1u << i);
+
+    mergeKeyboard(kb_report, &kb);
+
+    mouse_report->buttons |= mouse.buttons;
+    mouse_report->x = addMouseMovement(mouse_report->x, mouse.x);
+    mouse_report->y = addMouseMovement(mouse_report->y, mouse.y);
+    mouse_report->wheel = addMouseMovement(mouse_report->wheel, mouse.wheel);
+    mouse_report->pan = addMouseMovement(mouse_report->pan, mouse.pan);
+  }
+
+  if (changed || mask != _contrib_mask) {
+    _contrib_mask = mask;
+    _seq++;
+  }
+
+  return _seq;
+}
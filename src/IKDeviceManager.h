@@ -0,0 +1,82 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef ADAFRUIT_INTELLIKEYS_IKDEVICEMANAGER_H
+#define ADAFRUIT_INTELLIKEYS_IKDEVICEMANAGER_H
+
+#include "Adafruit_IntelliKeys.h"
+
+// number of IntelliKeys served at once (e.g behind a hub)
+#ifndef IK_MAX_DEVICES
+#define IK_MAX_DEVICES 4
+#endif
+
+// Serve several IntelliKeys: each device keeps its own state (membrane,
+// overlay, modifiers, command streams) in an Adafruit_IntelliKeys slot.
+// Host callbacks are routed by device address and the HID reports of all
+// devices are merged into one keyboard and one mouse report. The API mirrors
+// Adafruit_IntelliKeys so that a sketch can switch to it with few changes.
+class IKDeviceManager {
+public:
+  IKDeviceManager(void);
+
+  void begin(void);
+  bool mount(uint8_t daddr);
+  void umount(uint8_t daddr);
+  void Periodic(void);
+
+  // Merged keyboard and mouse report of all opened and switched on devices:
+  // modifiers and buttons are or-ed, keycodes are collected up to 6 and
+  // mouse movements are added. Return a sequence number which changes
+  // whenever a device report or the set of contributing devices changes.
+  uint32_t getHIDReport(hid_keyboard_report_t *kb_report,
+                        hid_mouse_report_t *mouse_report);
+
+  void setCustomOverlay(IKOverlay const *overlay, uint32_t count);
+
+  void hid_reprot_received_cb(uint8_t dev_addr, uint8_t instance,
+                              uint8_t const *report, uint16_t len);
+  void hid_report_sent_cb(uint8_t dev_addr, uint8_t instance,
+                          uint8_t const *report, uint16_t len);
+
+  // Any device attached, opened or switched on
+  bool isAttached(void);
+  bool IsOpen(void);
+  bool IsSwitchedOn(void);
+
+  uint8_t getDeviceCount(void);
+  Adafruit_IntelliKeys *getDevice(uint8_t daddr);
+  Adafruit_IntelliKeys *getDeviceByIndex(uint8_t index) {
+    return (index < IK_MAX_DEVICES) ? &_devices[index] : NULL;
+  }
+
+private:
+  Adafruit_IntelliKeys _devices[IK_MAX_DEVICES];
+
+  uint8_t _contrib_mask; // devices merged in last report
+  uint32_t _dev_seq[IK_MAX_DEVICES]; // report sequence of each device
+  uint32_t _seq; // bumped when a merged report or contributing devices change
+};
+
+#endif // ADAFRUIT_INTELLIKEYS_IKDEVICEMANAGER_H
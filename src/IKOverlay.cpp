@@ -25,69 +25,13 @@
 #include "IKOverlay.h"
 #include "class/hid/hid.h"
 
-#define IK_DEBUG 0
-
-#if IK_DEBUG
-#include <Arduino.h>
-#define IK_PRINTF(...) serial1_printf(__VA_ARGS__)
-#else
-#define IK_PRINTF(...)
-#endif
-
-IKOverlay stdOverlays[7];
-
-IKOverlay::IKOverlay() { memset(_membrane, 0, sizeof(_membrane)); }
-
-void IKOverlay::getSwitchReport(int nswitch, ik_report_t *report) {
-  (void)nswitch;
-  (void)report;
-}
-
-void IKOverlay::getMembraneReport(int row, int col, ik_report_t *report) {
-  if (row > IK_RESOLUTION_X || col > IK_RESOLUTION_Y) {
-    return;
-  }
-  *report = _membrane[row][col];
-}
-
-void IKOverlay::setMembraneReport(int top_row, int top_col, int height,
-                                  int width, ik_report_t *report) {
-  if (!(top_row < IK_RESOLUTION_X && top_col < IK_RESOLUTION_Y)) {
-    IK_PRINTF("Invalid top row or top col [%u, %u]\r\n", top_row, top_col);
-    return;
-  }
-
-  if (!((top_row + height <= IK_RESOLUTION_X) &&
-        (top_col + width <= IK_RESOLUTION_Y))) {
-    IK_PRINTF("Invalid height or width [%u, %u] + [%u, %u] = [%u, %u]\r\n",
-              top_row, top_col, height, width, top_row + height,
-              top_col + width);
-    return;
-  }
-
-  for (int row = top_row; row < top_row + height; row++) {
-    for (int col = top_col; col < top_col + width; col++) {
-      _membrane[row][col] = *report;
-    }
-  }
-}
-
-void IKOverlay::initStandardOverlays(void) {
-  initStdWebAccess();
-  initStdMathAccess();
-  initStdAlphabet();
-  initStdMouseAccess();
-  initStdQwerty();
-  initStdBasicWriting();
-}
-
 //--------------------------------------------------------------------+
 // Web Access
 //--------------------------------------------------------------------+
-void IKOverlay::initStdWebAccess(void) {
-  IKOverlay &overlay = stdOverlays[IK_OVERLAY_WEB_ACCESS];
+constexpr IKOverlay IKOverlay::initStdWebAccess(void) {
+  IKOverlay overlay;
 
-  int row, col;
+  int row = 0, col = 0;
   int const height = 3;
   int const width = 2;
 
@@ -137,18 +81,20 @@ void IKOverlay::initStdWebAccess(void) {
 
   // Row 3 to 8
   initStdQwertyRow3to8(overlay, true);
+
+  return overlay;
 }
 
 //--------------------------------------------------------------------+
 // Math Access
 //--------------------------------------------------------------------+
-void IKOverlay::initStdMathAccess(void) {
-  IKOverlay &overlay = stdOverlays[IK_OVERLAY_MATH_ACCESS];
+constexpr IKOverlay IKOverlay::initStdMathAccess(void) {
+  IKOverlay overlay;
 
   ik_report_t kb_report = {.type = IK_REPORT_TYPE_KEYBOARD, .keyboard = {0, 0}};
   ik_report_t mouse_report = {.type = IK_REPORT_TYPE_MOUSE, .mouse = {0, 0, 0}};
 
-  int row, col, height, width;
+  int row = 0, col = 0, height = 0, width = 0;
 
   //------------- Calculator -------------//
   height = 6;
@@ -267,18 +213,20 @@ void IKOverlay::initStdMathAccess(void) {
   mouse_report.mouse.buttons = IK_REPORT_MOUSE_CLICK_HOLD;
   mouse_report.mouse.x = mouse_report.mouse.y = 0;
   overlay.setMembraneReport(row, col, height, 2 * width, &mouse_report);
+
+  return overlay;
 }
 
 //--------------------------------------------------------------------+
 // Basic Writing
 //--------------------------------------------------------------------+
-void IKOverlay::initStdBasicWriting(void) {
-  IKOverlay &overlay = stdOverlays[IK_OVERLAY_BASIC_WRITING];
+constexpr IKOverlay IKOverlay::initStdBasicWriting(void) {
+  IKOverlay overlay;
 
   ik_report_t kb_report = {.type = IK_REPORT_TYPE_KEYBOARD, .keyboard = {0, 0}};
   ik_report_t mouse_report = {.type = IK_REPORT_TYPE_MOUSE, .mouse = {0, 0, 0}};
 
-  int row, col;
+  int row = 0, col = 0;
 
   // for most keys, height = 3, width = 2
   int const height = 3;
@@ -426,18 +374,20 @@ void IKOverlay::initStdBasicWriting(void) {
 
   overlay.setMembraneKeyboardArr(row, col, height, width, eighth_row,
                                  sizeof(eighth_row) / sizeof(eighth_row[0]));
+
+  return overlay;
 }
 
 //--------------------------------------------------------------------+
 // Mouse Overlay
 //--------------------------------------------------------------------+
-void IKOverlay::initStdMouseAccess(void) {
-  IKOverlay &overlay = stdOverlays[IK_OVERLAY_MOUSE_ACCESS];
+constexpr IKOverlay IKOverlay::initStdMouseAccess(void) {
+  IKOverlay overlay;
 
   ik_report_t kb_report = {.type = IK_REPORT_TYPE_KEYBOARD, .keyboard = {0, 0}};
   ik_report_t mouse_report = {.type = IK_REPORT_TYPE_MOUSE, .mouse = {0, 0, 0}};
 
-  int col, row;
+  int col = 0, row = 0;
   int const height = 6;
   int const width = 4;
 
@@ -512,19 +462,19 @@ void IKOverlay::initStdMouseAccess(void) {
 
   overlay.setMembraneMouseArr(row, col, height, width, mouse_4th,
                               sizeof(mouse_4th) / sizeof(mouse_4th[0]));
+
+  return overlay;
 }
 
 // --------------------------------------------------------------------+
 // Qwerty Overlay
 //--------------------------------------------------------------------+
-void IKOverlay::initStdQwerty(void) {
-  IKOverlay &overlay = stdOverlays[IK_OVERLAY_QWERTY];
+constexpr IKOverlay IKOverlay::initStdQwerty(void) {
+  IKOverlay overlay;
 
-  ik_report_t report;
-  report.type = IK_REPORT_TYPE_KEYBOARD;
-  report.keyboard.modifier = 0;
+  ik_report_t report = {.type = IK_REPORT_TYPE_KEYBOARD, .keyboard = {0, 0}};
 
-  int col, row;
+  int col = 0, row = 0;
   int const height = 3;
   int const width = 2;
 
@@ -563,14 +513,15 @@ void IKOverlay::initStdQwerty(void) {
 
   // Row 3 to 8
   initStdQwertyRow3to8(overlay, false);
+
+  return overlay;
 }
 
-void IKOverlay::initStdQwertyRow3to8(IKOverlay &overlay, bool is_web) {
-  ik_report_t report;
-  report.type = IK_REPORT_TYPE_KEYBOARD;
-  report.keyboard.modifier = 0;
+constexpr void IKOverlay::initStdQwertyRow3to8(IKOverlay &overlay,
+                                               bool is_web) {
+  ik_report_t report = {.type = IK_REPORT_TYPE_KEYBOARD, .keyboard = {0, 0}};
 
-  int col, row;
+  int col = 0, row = 0;
   int const height = 3;
   int const width = 2;
 
@@ -695,14 +646,12 @@ void IKOverlay::initStdQwertyRow3to8(IKOverlay &overlay, bool is_web) {
 //--------------------------------------------------------------------+
 // Alphabet Overlay
 //--------------------------------------------------------------------+
-void IKOverlay::initStdAlphabet(void) {
-  IKOverlay &overlay = stdOverlays[IK_OVERLAY_ALPHABET];
+constexpr IKOverlay IKOverlay::initStdAlphabet(void) {
+  IKOverlay overlay;
 
-  ik_report_t report;
-  report.type = IK_REPORT_TYPE_KEYBOARD;
-  report.keyboard.modifier = 0;
+  ik_report_t report = {.type = IK_REPORT_TYPE_KEYBOARD, .keyboard = {0, 0}};
 
-  int row, col;
+  int row = 0, col = 0;
   int const height = 4;
   int width = 3;
 
@@ -810,35 +759,12 @@ void IKOverlay::initStdAlphabet(void) {
   report.keyboard.modifier = 0;
   report.keyboard.keycode = HID_KEY_SPACE;
   overlay.setMembraneReport(row, col, height, 2 * width, &report);
-}
-
-void IKOverlay::setMembraneKeyboardArr(int row, int col, int height, int width,
-                                       const ik_report_keyboard_t kbd_report[],
-                                       uint8_t count) {
-  for (uint8_t i = 0; i < count; i++) {
-    ik_report_t report;
-    report.type = IK_REPORT_TYPE_KEYBOARD;
-    report.keyboard = kbd_report[i];
 
-    setMembraneReport(row, col, height, width, &report);
-    col += width;
-  }
+  return overlay;
 }
 
-void IKOverlay::setMembraneMouseArr(int row, int col, int height, int width,
-                                    ik_report_mouse_t const mouse_report[],
-                                    uint8_t count) {
-  for (uint8_t i = 0; i < count; i++) {
-    ik_report_t report;
-    report.type = IK_REPORT_TYPE_MOUSE;
-    report.mouse = mouse_report[i];
-
-    setMembraneReport(row, col, height, width, &report);
-    col += width;
-  }
-}
-
-void IKOverlay::initQwertyRow(int row, int col, int height, int width) {
+constexpr void IKOverlay::initQwertyRow(int row, int col, int height,
+                                        int width) {
   ik_report_keyboard_t kbd_item[] = {
       {0, HID_KEY_Q}, {0, HID_KEY_W}, {0, HID_KEY_E}, {0, HID_KEY_R},
       {0, HID_KEY_T}, {0, HID_KEY_Y}, {0, HID_KEY_U}, {0, HID_KEY_I},
@@ -848,7 +774,8 @@ void IKOverlay::initQwertyRow(int row, int col, int height, int width) {
                          sizeof(kbd_item) / sizeof(kbd_item[0]));
 }
 
-void IKOverlay::initAsdfghRow(int row, int col, int height, int width) {
+constexpr void IKOverlay::initAsdfghRow(int row, int col, int height,
+                                        int width) {
   ik_report_keyboard_t kbd_item[] = {
       {0, HID_KEY_A}, {0, HID_KEY_S}, {0, HID_KEY_D},
       {0, HID_KEY_F}, {0, HID_KEY_G}, {0, HID_KEY_H},
@@ -858,7 +785,8 @@ void IKOverlay::initAsdfghRow(int row, int col, int height, int width) {
                          sizeof(kbd_item) / sizeof(kbd_item[0]));
 }
 
-void IKOverlay::initZxcvbnRow(int row, int col, int height, int width) {
+constexpr void IKOverlay::initZxcvbnRow(int row, int col, int height,
+                                        int width) {
   ik_report_keyboard_t kb_item[] = {
       {0, HID_KEY_Z}, {0, HID_KEY_X}, {0, HID_KEY_C}, {0, HID_KEY_V},
       {0, HID_KEY_B}, {0, HID_KEY_N}, {0, HID_KEY_M}};
@@ -866,3 +794,16 @@ void IKOverlay::initZxcvbnRow(int row, int col, int height, int width) {
   setMembraneKeyboardArr(row, col, height, width, kb_item,
                          sizeof(kb_item) / sizeof(kb_item[0]));
 }
+
+//--------------------------------------------------------------------+
+// Standard overlays table
+//--------------------------------------------------------------------+
+
+uint8_t IKOverlay::reportTableFull(void) { return 0; }
+
+constexpr IKOverlay stdOverlays[7] = {
+    IKOverlay::initStdWebAccess(),   IKOverlay(), // setup is not supported
+    IKOverlay::initStdMathAccess(),  IKOverlay::initStdAlphabet(),
+    IKOverlay::initStdMouseAccess(), IKOverlay::initStdQwerty(),
+    IKOverlay::initStdBasicWriting()};
+
@@ -72,45 +72,160 @@ typedef struct __attribute__((packed)) {
   };
 } ik_report_t;
 
+// Max number of unique reports (keys) per overlay. Each membrane cell stores
+// a 1-byte index into the report table, index 0 is reserved for no report.
+#ifndef IK_OVERLAY_MAX_REPORTS
+#define IK_OVERLAY_MAX_REPORTS 96
+#endif
+
+static_assert(IK_OVERLAY_MAX_REPORTS <= 256,
+              "report index must fit in a membrane cell byte");
+
+// Overlay map of membrane cells to keyboard/mouse reports. All methods used
+// to build an overlay are constexpr so that standard overlays are generated by
+// the compiler and placed in flash (see IKOverlay.cpp). Custom overlays can
+// use the same methods at runtime.
 class IKOverlay {
 public:
-  IKOverlay();
-
-  // Init all std overlays
-  static void initStandardOverlays(void);
-
-  void setMembraneReport(int top_row, int top_col, int height, int width,
-                         ik_report_t *report);
-
-  void getSwitchReport(int nswitch, ik_report_t *report);
-  void getMembraneReport(int row, int col, ik_report_t *report);
-
-  void setMembraneKeyboardArr(int row, int col, int height, int width,
-                              const ik_report_keyboard_t kbd_report[],
-                              uint8_t count);
-  void setMembraneMouseArr(int row, int col, int height, int width,
-                           ik_report_mouse_t const mouse_report[],
-                           uint8_t count);
+  constexpr IKOverlay() : _membrane{}, _reports{}, _report_count(1) {}
+
+  // Standard overlays are generated at compile time, kept for compatibility
+  static void initStandardOverlays(void) {}
+
+  // Return false if the area is invalid or the report table is full, cells
+  // are left unchanged
+  constexpr bool setMembraneReport(int top_row, int top_col, int height,
+                                   int width, ik_report_t const *report) {
+    if (!(0 <= top_row && top_row < IK_RESOLUTION_Y && 0 <= top_col &&
+          top_col < IK_RESOLUTION_X)) {
+      return false; // invalid top row or top col
+    }
+
+    if (!((top_row + height <= IK_RESOLUTION_Y) &&
+          (top_col + width <= IK_RESOLUTION_X))) {
+      return false; // invalid height or width
+    }
+
+    uint8_t const index = findOrAddReport(report);
+    if (index == 0 && report->type != IK_REPORT_TYPE_NONE) {
+      return false;
+    }
+
+    for (int row = top_row; row < top_row + height; row++) {
+      for (int col = top_col; col < top_col + width; col++) {
+        _membrane[row][col] = index;
+      }
+    }
+    return true;
+  }
+
+  void getSwitchReport(int nswitch, ik_report_t *report) const {
+    (void)nswitch;
+    (void)report;
+  }
+
+  // out of range row or col gives no report
+  constexpr void getMembraneReport(int row, int col,
+                                   ik_report_t *report) const {
+    if (row < 0 || row >= IK_RESOLUTION_Y || col < 0 ||
+        col >= IK_RESOLUTION_X) {
+      *report = _reports[0];
+      return;
+    }
+    *report = _reports[_membrane[row][col]];
+  }
+
+  constexpr void setMembraneKeyboardArr(int row, int col, int height,
+                                        int width,
+                                        const ik_report_keyboard_t kbd_report[],
+                                        uint8_t count) {
+    for (uint8_t i = 0; i < count; i++) {
+      ik_report_t const report = {.type = IK_REPORT_TYPE_KEYBOARD,
+                                  .keyboard = kbd_report[i]};
+      setMembraneReport(row, col, height, width, &report);
+      col += width;
+    }
+  }
+
+  constexpr void setMembraneMouseArr(int row, int col, int height, int width,
+                                     ik_report_mouse_t const mouse_report[],
+                                     uint8_t count) {
+    for (uint8_t i = 0; i < count; i++) {
+      ik_report_t const report = {.type = IK_REPORT_TYPE_MOUSE,
+                                  .mouse = mouse_report[i]};
+      setMembraneReport(row, col, height, width, &report);
+      col += width;
+    }
+  }
+
+  // number of unique reports in use
+  constexpr uint16_t getReportCount(void) const { return _report_count; }
+
+  // Standard overlays
+  static constexpr IKOverlay initStdWebAccess(void);
+  static constexpr IKOverlay initStdMathAccess(void);
+  static constexpr IKOverlay initStdAlphabet(void);
+  static constexpr IKOverlay initStdMouseAccess(void);
+  static constexpr IKOverlay initStdQwerty(void);
+  static constexpr IKOverlay initStdBasicWriting(void);
 
 private:
-  ik_report_t _membrane[IK_RESOLUTION_X][IK_RESOLUTION_Y];
-
-  // init each std overlays
-  static void initStdWebAccess(void);
-  static void initStdMathAccess(void);
-  static void initStdAlphabet(void);
-  static void initStdMouseAccess(void);
-  static void initStdQwerty(void);
-  static void initStdBasicWriting(void);
-
-  static void initStdQwertyRow3to8(IKOverlay &overlay, bool is_web);
+  uint8_t _membrane[IK_RESOLUTION_Y][IK_RESOLUTION_X]; // index to _reports
+  ik_report_t _reports[IK_OVERLAY_MAX_REPORTS]; // [0] is no report
+  uint16_t _report_count;
+
+  // compare only the active union member, the rest may be garbage
+  static constexpr bool isSameReport(ik_report_t const *a,
+                                     ik_report_t const *b) {
+    if (a->type != b->type) {
+      return false;
+    }
+
+    if (a->type == IK_REPORT_TYPE_KEYBOARD) {
+      return a->keyboard.modifier == b->keyboard.modifier &&
+             a->keyboard.keycode == b->keyboard.keycode;
+    } else if (a->type == IK_REPORT_TYPE_MOUSE) {
+      return a->mouse.buttons == b->mouse.buttons && a->mouse.x == b->mouse.x &&
+             a->mouse.y == b->mouse.y;
+    }
+
+    return true;
+  }
+
+  // Not constexpr: a full table while building a standard overlay is a
+  // compile error, at runtime setMembraneReport() returns false
+  static uint8_t reportTableFull(void);
+
+  // Return table index of report, add it if not found. Return 0 (no report) if
+  // table is full
+  constexpr uint8_t findOrAddReport(ik_report_t const *report) {
+    if (report->type == IK_REPORT_TYPE_NONE) {
+      return 0;
+    }
+
+    for (uint8_t i = 1; i < _report_count; i++) {
+      if (isSameReport(&_reports[i], report)) {
+        return i;
+      }
+    }
+
+    if (_report_count >= IK_OVERLAY_MAX_REPORTS) {
+      return reportTableFull(); // increase IK_OVERLAY_MAX_REPORTS
+    }
+
+    _reports[_report_count] = *report;
+    return (uint8_t)_report_count++;
+  }
+
+  static constexpr void initStdQwertyRow3to8(IKOverlay &overlay, bool is_web);
 
   // init row QWERTY
-  void initQwertyRow(int row, int col, int height, int width);
-  void initAsdfghRow(int row, int col, int height, int width);
-  void initZxcvbnRow(int row, int col, int height, int width);
+  constexpr void initQwertyRow(int row, int col, int height, int width);
+  constexpr void initAsdfghRow(int row, int col, int height, int width);
+  constexpr void initZxcvbnRow(int row, int col, int height, int width);
 };
 
-extern IKOverlay stdOverlays[7];
+// Standard overlays, generated at compile time
+extern const IKOverlay stdOverlays[7];
 
 #endif // ADAFRUIT_INTELLIKEYS_IKOVERLAY_H
@@ -0,0 +1,148 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "IKSensor.h"
+
+static_assert(IK_SENSOR_WINDOW & 1, "median window must be odd");
+
+IKSensor::IKSensor(void) {
+  memset(&m_stats, 0, sizeof(m_stats));
+  Reset(0);
+}
+
+void IKSensor::Reset(int threshold) {
+  memset(m_ring, 0, sizeof(m_ring));
+  m_head = 0;
+  m_primed = false;
+  m_latest = 0;
+  m_filtered = 0;
+  m_pending = false;
+  m_stable = true;
+  m_bit = false;
+  m_confident = false;
+  m_decided = false;
+  m_threshold = threshold;
+  m_levelMask = 0;
+}
+
+// bit is re-evaluated on next sample
+void IKSensor::SetThreshold(int threshold) {
+  m_threshold = threshold;
+  m_stable = false;
+}
+
+void IKSensor::SetCalibration(uint8_t low, uint8_t high) {
+  m_level[0] = (uint16_t)(low << 4);
+  m_level[1] = (uint16_t)(high << 4);
+  m_levelMask = 0x03;
+  SetThreshold((low + high) / 2);
+}
+
+bool IKSensor::GetCalibration(uint8_t *low, uint8_t *high) const {
+  if (m_levelMask != 0x03) {
+    return false;
+  }
+  *low = (uint8_t)(m_level[0] >> 4);
+  *high = (uint8_t)(m_level[1] >> 4);
+  return true;
+}
+
+// move level of the current bit toward the filtered value
+void IKSensor::Calibrate(void) {
+  uint8_t const n = m_bit ? 1 : 0;
+  int const value = m_filtered << 4;
+
+  if (m_levelMask & (1u << n)) {
+    int const level = m_level[n];
+    int const step = (value - level) / (1 << IK_SENSOR_CAL_SHIFT);
+    m_level[n] = (uint16_t)(level + step);
+  } else {
+    m_level[n] = (uint16_t)value;
+    m_levelMask |= (uint8_t)(1u << n);
+  }
+
+  if (m_levelMask == 0x03) {
+    int const low = m_level[0] >> 4;
+    int const high = m_level[1] >> 4;
+    if (high - low >= IK_SENSOR_CAL_SPAN) {
+      m_threshold = (low + high) / 2;
+    }
+  }
+}
+
+bool IKSensor::Sample(void) {
+  // held value already filled the window
+  if (!m_pending && m_stable) {
+    return false;
+  }
+  m_pending = false;
+
+  // first sample after Reset() fills the window, not a median with zeros
+  if (m_primed) {
+    m_ring[m_head] = m_latest;
+  } else {
+    memset(m_ring, m_latest, sizeof(m_ring));
+    m_primed = true;
+  }
+  m_head = (uint8_t)((m_head + 1) % IK_SENSOR_WINDOW);
+  m_stats.filtered++;
+
+  // median by insertion sort, window is tiny
+  uint8_t sorted[IK_SENSOR_WINDOW];
+  bool stable = true;
+  for (uint8_t i = 0; i < IK_SENSOR_WINDOW; i++) {
+    uint8_t const v = m_ring[i];
+    stable = stable && (v == m_latest);
+
+    uint8_t j = i;
+    for (; j > 0 && sorted[j - 1] > v; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = v;
+  }
+  m_stable = stable;
+  m_filtered = sorted[IK_SENSOR_WINDOW / 2];
+
+  // no bit to hold yet, plain comparison until the first confident one
+  if (!m_decided) {
+    m_bit = m_filtered > m_threshold;
+  }
+
+  if (m_filtered > m_threshold + IK_SENSOR_HYSTERESIS) {
+    m_bit = true;
+    m_confident = true;
+  } else if (m_filtered < m_threshold - IK_SENSOR_HYSTERESIS) {
+    m_bit = false;
+    m_confident = true;
+  } else {
+    m_confident = false;
+  }
+  m_decided = m_decided || m_confident;
+
+  if (m_confident) {
+    Calibrate();
+  }
+
+  return true;
+}
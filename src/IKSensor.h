@@ -0,0 +1,135 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (thach@tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef ADAFRUIT_INTELLIKEYS_IKSENSOR_H
+#define ADAFRUIT_INTELLIKEYS_IKSENSOR_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Number of samples of the median filter, odd
+#ifndef IK_SENSOR_WINDOW
+#define IK_SENSOR_WINDOW 3
+#endif
+
+// Sensors are sampled every IK_SENSOR_PERIOD ms by Periodic(), sensor change
+// events in between only update the latest raw value
+#ifndef IK_SENSOR_PERIOD
+#define IK_SENSOR_PERIOD 10
+#endif
+
+// Threshold used until the calibration is read from EEPROM
+#ifndef IK_SENSOR_MIDWAY
+#define IK_SENSOR_MIDWAY 150
+#endif
+
+// A sensor bit only flips once the filtered value is this far past the
+// threshold, values within the band keep the bit and are not confident. Until
+// the first confident value after Reset() the bit is a plain comparison.
+#ifndef IK_SENSOR_HYSTERESIS
+#define IK_SENSOR_HYSTERESIS 16
+#endif
+
+// Online calibration: filtered values clear of the hysteresis band are
+// averaged into a low and a high level with weight 1/2^IK_SENSOR_CAL_SHIFT,
+// the threshold follows their midpoint once they are IK_SENSOR_CAL_SPAN apart
+#ifndef IK_SENSOR_CAL_SHIFT
+#define IK_SENSOR_CAL_SHIFT 3
+#endif
+
+#ifndef IK_SENSOR_CAL_SPAN
+#define IK_SENSOR_CAL_SPAN 32
+#endif
+
+typedef struct {
+  uint32_t samples;   // sensor change events
+  uint32_t dropped;   // events with the value already held
+  uint32_t decimated; // events replaced by a later one before sampling
+  uint32_t filtered;  // samples run through the filter
+} ik_sensor_stats_t;
+
+// One overlay bar-code sensor. Change events only store the raw value, which
+// is sampled on a fixed period into a small ring and median filtered, so that
+// noise bursts cost a store per event and a single spike never flips the bit.
+// The threshold starts from the EEPROM calibration and is refined by the
+// levels seen, with a hysteresis band around it.
+class IKSensor {
+public:
+  IKSensor(void);
+
+  void Reset(int threshold);
+  void SetThreshold(int threshold);
+
+  // Set low and high levels e.g from EEPROM black and white, threshold is
+  // their midpoint. Get return false until both levels are known.
+  void SetCalibration(uint8_t low, uint8_t high);
+  bool GetCalibration(uint8_t *low, uint8_t *high) const;
+
+  // event path, keep it cheap
+  void OnChange(uint8_t value) {
+    m_stats.samples++;
+    if (value == m_latest) {
+      m_stats.dropped++;
+      return;
+    }
+    if (m_pending) {
+      m_stats.decimated++;
+    }
+    m_latest = value;
+    m_pending = true;
+  }
+
+  // Sample latest value into the filter, return false if there was nothing to
+  // filter i.e IsSet() can not have changed
+  bool Sample(void);
+
+  bool IsSet(void) const { return m_bit; }
+  bool IsConfident(void) const { return m_confident; }
+  uint8_t GetValue(void) const { return m_filtered; }
+  uint8_t GetRaw(void) const { return m_latest; }
+  int GetThreshold(void) const { return m_threshold; }
+  ik_sensor_stats_t const *GetStats(void) const { return &m_stats; }
+
+private:
+  void Calibrate(void);
+
+  uint8_t m_ring[IK_SENSOR_WINDOW];
+  uint8_t m_head;
+  bool m_primed; // ring filled by the first sample
+  uint8_t m_latest;
+  uint8_t m_filtered;
+  bool m_pending; // latest not sampled yet
+  bool m_stable;  // ring holds the same value, nothing to filter
+  bool m_bit;
+  bool m_confident; // filtered value is outside the hysteresis band
+  bool m_decided;   // was confident since Reset(), hysteresis applies
+  int m_threshold;
+
+  uint16_t m_level[2]; // low and high level in 1/16
+  uint8_t m_levelMask; // bit n set when m_level[n] is known
+
+  ik_sensor_stats_t m_stats;
+};
+
+#endif // ADAFRUIT_INTELLIKEYS_IKSENSOR_H
@@ -0,0 +1,353 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef ADAFRUIT_INTELLIKEYS_IK_EZUSB_IMAGE_H
+#define ADAFRUIT_INTELLIKEYS_IK_EZUSB_IMAGE_H
+
+#include <stddef.h>
+
+#include "intellikeysdefs.h"
+
+// Max size of a firmware download control transfer, runs are split into
+// chunks of this size. Should be a multiple of the control endpoint size (64)
+#ifndef IK_EZUSB_MAX_XFER
+#define IK_EZUSB_MAX_XFER 1024
+#endif
+
+// Store firmware images compressed, chunks are decompressed into a staging
+// buffer of IK_EZUSB_MAX_XFER bytes during download
+#ifndef IK_EZUSB_COMPRESS
+#define IK_EZUSB_COMPRESS 0
+#endif
+
+// Packed EZ-USB image: a list of runs, each is a header followed by the run
+// payload, terminated by a header with zero length.
+//
+//   plain      : addr (u16 le) | len (u16 le) | data[len]
+//   compressed : addr (u16 le) | len (u16 le) | size (u16 le) | lz[size]
+//
+// A run holds the data of consecutive hex records with contiguous addresses
+// in the same ram (internal or external). Images are generated from the
+// INTEL_HEX_RECORD tables at compile time with IK_EZUSB_IMAGE() or
+// IK_EZUSB_LZ_IMAGE(), and read back in place with ik_ezusb_next_run() so that
+// the payload is sent straight from flash.
+//
+// Compressed payload is a sequence of tokens, each chunk of IK_EZUSB_MAX_XFER
+// bytes is compressed on its own so that matches never refer to data outside
+// the staging buffer:
+//
+//   0lllllll               : (l + 1) literal bytes follow
+//   1mmmmmdd dddddddd      : copy (m + 3) bytes from (d + 1) bytes back
+
+#define IK_EZUSB_RUN_HEADER_SIZE 4
+#define IK_EZUSB_LZ_RUN_HEADER_SIZE 6
+
+#define IK_EZUSB_LZ_MIN_MATCH 3
+#define IK_EZUSB_LZ_MAX_MATCH (IK_EZUSB_LZ_MIN_MATCH + 31)
+#define IK_EZUSB_LZ_MAX_LITERAL 128
+#define IK_EZUSB_LZ_WINDOW 1024
+#define IK_EZUSB_LZ_HASH_SIZE 1024
+
+#define IK_EZUSB_IMAGE(_records)                                               \
+  ik_ezusb_image_build<ik_ezusb_image_size(_records)>(_records)
+
+#define IK_EZUSB_LZ_IMAGE(_records)                                            \
+  ik_ezusb_lz_build<ik_ezusb_lz_size(IK_EZUSB_IMAGE(_records))>(               \
+      IK_EZUSB_IMAGE(_records))
+
+template <size_t SIZE> struct ik_ezusb_image_t {
+  uint8_t data[SIZE];
+};
+
+typedef struct {
+  uint16_t addr;
+  uint16_t len;        // data length
+  uint16_t size;       // payload size in image
+  uint8_t const *data; // payload
+} ik_ezusb_run_t;
+
+// Read the run at *image and advance *image to the next one. Return false at
+// the end of image
+static constexpr bool ik_ezusb_next_run(uint8_t const **image,
+                                        ik_ezusb_run_t *run,
+                                        bool compressed = false) {
+  uint8_t const *p = *image;
+
+  run->addr = (uint16_t)(p[0] | (p[1] << 8));
+  run->len = (uint16_t)(p[2] | (p[3] << 8));
+
+  if (compressed) {
+    run->size = (uint16_t)(p[4] | (p[5] << 8));
+    run->data = p + IK_EZUSB_LZ_RUN_HEADER_SIZE;
+  } else {
+    run->size = run->len;
+    run->data = p + IK_EZUSB_RUN_HEADER_SIZE;
+  }
+
+  if (run->len == 0) {
+    return false;
+  }
+
+  *image = run->data + run->size;
+  return true;
+}
+
+// CRC32 (IEEE 802.3) used to verify downloaded chunks
+struct ik_ezusb_crc32_table_t {
+  uint32_t value[256];
+};
+
+static constexpr ik_ezusb_crc32_table_t ik_ezusb_crc32_table_build(void) {
+  ik_ezusb_crc32_table_t table{};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : (crc >> 1);
+    }
+    table.value[i] = crc;
+  }
+  return table;
+}
+
+static constexpr ik_ezusb_crc32_table_t ik_ezusb_crc32_table =
+    ik_ezusb_crc32_table_build();
+
+static inline uint32_t ik_ezusb_crc32(uint8_t const *data, uint16_t len) {
+  uint32_t crc = 0xFFFFFFFFu;
+  for (uint16_t i = 0; i < len; i++) {
+    crc = ik_ezusb_crc32_table.value[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+//--------------------------------------------------------------------+
+// Plain image
+//--------------------------------------------------------------------+
+
+// Return true if record continues the run of the previous record
+static constexpr bool ik_ezusb_same_run(INTEL_HEX_RECORD const &prev,
+                                        INTEL_HEX_RECORD const &rec) {
+  return prev.Address + prev.Length == rec.Address &&
+         INTERNAL_RAM(prev.Address) == INTERNAL_RAM(rec.Address);
+}
+
+template <size_t N>
+constexpr size_t ik_ezusb_image_size(INTEL_HEX_RECORD const (&records)[N]) {
+  size_t size = IK_EZUSB_RUN_HEADER_SIZE; // terminator
+  for (size_t i = 0; i < N && records[i].Type == 0; i++) {
+    if (i == 0 || !ik_ezusb_same_run(records[i - 1], records[i])) {
+      size += IK_EZUSB_RUN_HEADER_SIZE;
+    }
+    size += records[i].Length;
+  }
+  return size;
+}
+
+template <size_t SIZE, size_t N>
+constexpr ik_ezusb_image_t<SIZE>
+ik_ezusb_image_build(INTEL_HEX_RECORD const (&records)[N]) {
+  ik_ezusb_image_t<SIZE> image{};
+  size_t pos = 0;
+  size_t header = 0;
+
+  for (size_t i = 0; i < N && records[i].Type == 0; i++) {
+    INTEL_HEX_RECORD const &rec = records[i];
+
+    if (i == 0 || !ik_ezusb_same_run(records[i - 1], rec)) {
+      header = pos;
+      image.data[header] = (uint8_t)(rec.Address & 0xff);
+      image.data[header + 1] = (uint8_t)(rec.Address >> 8);
+      pos += IK_EZUSB_RUN_HEADER_SIZE;
+    }
+
+    for (uint8_t j = 0; j < rec.Length; j++) {
+      image.data[pos++] = rec.Data[j];
+    }
+
+    size_t const len = pos - header - IK_EZUSB_RUN_HEADER_SIZE;
+    image.data[header + 2] = (uint8_t)(len & 0xff);
+    image.data[header + 3] = (uint8_t)(len >> 8);
+  }
+
+  // terminator is already zeroed
+  return image;
+}
+
+//--------------------------------------------------------------------+
+// Compressed image
+//--------------------------------------------------------------------+
+
+static constexpr uint16_t ik_ezusb_lz_hash(uint8_t const *p) {
+  return (uint16_t)(((p[0] << 4) ^ p[1]) & (IK_EZUSB_LZ_HASH_SIZE - 1));
+}
+
+// Compress a chunk with greedy longest match, write tokens to dst unless it is
+// NULL. Return compressed size. Candidates are found with hash chains of the
+// first 2 bytes to stay within the compiler constexpr evaluation limit.
+static constexpr size_t ik_ezusb_lz_chunk(uint8_t const *src, size_t len,
+                                          uint8_t *dst) {
+  // chain entries are position + 1, 0 ends the chain
+  uint16_t head[IK_EZUSB_LZ_HASH_SIZE] = {};
+  uint16_t prev[IK_EZUSB_MAX_XFER] = {};
+  size_t hashed = 0;
+
+  size_t out = 0;
+  size_t literal_header = 0;
+  size_t literal_count = 0;
+  size_t i = 0;
+
+  while (i < len) {
+    for (; hashed < i && hashed + 1 < len; hashed++) {
+      uint16_t const h = ik_ezusb_lz_hash(src + hashed);
+      prev[hashed] = head[h];
+      head[h] = (uint16_t)(hashed + 1);
+    }
+
+    size_t best_len = 0;
+    size_t best_dist = 0;
+
+    if (i + 1 < len) {
+      for (uint16_t c = head[ik_ezusb_lz_hash(src + i)]; c; c = prev[c - 1]) {
+        size_t const s = c - 1;
+        if (i - s > IK_EZUSB_LZ_WINDOW) {
+          break; // chain is ordered from nearest
+        }
+
+        size_t n = 0;
+        while (i + n < len && n < IK_EZUSB_LZ_MAX_MATCH &&
+               src[s + n] == src[i + n]) {
+          n++;
+        }
+        if (n > best_len) {
+          best_len = n;
+          best_dist = i - s;
+        }
+      }
+    }
+
+    if (best_len >= IK_EZUSB_LZ_MIN_MATCH) {
+      if (dst) {
+        dst[out] = (uint8_t)(0x80 | ((best_len - IK_EZUSB_LZ_MIN_MATCH) << 2) |
+                             ((best_dist - 1) >> 8));
+        dst[out + 1] = (uint8_t)((best_dist - 1) & 0xff);
+      }
+      out += 2;
+      literal_count = 0;
+      i += best_len;
+    } else {
+      if (literal_count == 0) {
+        literal_header = out++;
+      }
+      if (dst) {
+        dst[literal_header] = (uint8_t)literal_count;
+        dst[out] = src[i];
+      }
+      out++;
+      i++;
+      if (++literal_count == IK_EZUSB_LZ_MAX_LITERAL) {
+        literal_count = 0;
+      }
+    }
+  }
+
+  return out;
+}
+
+// Decompress a chunk of len bytes from *src into dst, advance *src
+static constexpr void ik_ezusb_lz_decode(uint8_t const **src, uint8_t *dst,
+                                         uint16_t len) {
+  uint8_t const *p = *src;
+  uint16_t i = 0;
+
+  while (i < len) {
+    uint8_t const token = *p++;
+
+    if (token & 0x80) {
+      uint16_t const count = ((token >> 2) & 0x1f) + IK_EZUSB_LZ_MIN_MATCH;
+      uint16_t const dist = (uint16_t)((((token & 0x03) << 8) | *p++) + 1);
+      for (uint16_t n = 0; n < count; n++, i++) {
+        dst[i] = dst[i - dist]; // may overlap
+      }
+    } else {
+      for (uint16_t n = 0; n <= token; n++) {
+        dst[i++] = *p++;
+      }
+    }
+  }
+
+  *src = p;
+}
+
+template <size_t SIZE>
+constexpr size_t ik_ezusb_lz_size(ik_ezusb_image_t<SIZE> const &image) {
+  size_t size = IK_EZUSB_LZ_RUN_HEADER_SIZE; // terminator
+  uint8_t const *p = image.data;
+  ik_ezusb_run_t run{};
+
+  while (ik_ezusb_next_run(&p, &run)) {
+    size += IK_EZUSB_LZ_RUN_HEADER_SIZE;
+    for (size_t offset = 0; offset < run.len; offset += IK_EZUSB_MAX_XFER) {
+      size_t const len = (run.len - offset < IK_EZUSB_MAX_XFER)
+                             ? run.len - offset
+                             : IK_EZUSB_MAX_XFER;
+      size += ik_ezusb_lz_chunk(run.data + offset, len, nullptr);
+    }
+  }
+
+  return size;
+}
+
+template <size_t LZ_SIZE, size_t SIZE>
+constexpr ik_ezusb_image_t<LZ_SIZE>
+ik_ezusb_lz_build(ik_ezusb_image_t<SIZE> const &image) {
+  ik_ezusb_image_t<LZ_SIZE> lz{};
+  size_t pos = 0;
+  uint8_t const *p = image.data;
+  ik_ezusb_run_t run{};
+
+  while (ik_ezusb_next_run(&p, &run)) {
+    size_t const header = pos;
+    pos += IK_EZUSB_LZ_RUN_HEADER_SIZE;
+
+    for (size_t offset = 0; offset < run.len; offset += IK_EZUSB_MAX_XFER) {
+      size_t const len = (run.len - offset < IK_EZUSB_MAX_XFER)
+                             ? run.len - offset
+                             : IK_EZUSB_MAX_XFER;
+      pos += ik_ezusb_lz_chunk(run.data + offset, len, lz.data + pos);
+    }
+
+    size_t const size = pos - header - IK_EZUSB_LZ_RUN_HEADER_SIZE;
+    lz.data[header] = (uint8_t)(run.addr & 0xff);
+    lz.data[header + 1] = (uint8_t)(run.addr >> 8);
+    lz.data[header + 2] = (uint8_t)(run.len & 0xff);
+    lz.data[header + 3] = (uint8_t)(run.len >> 8);
+    lz.data[header + 4] = (uint8_t)(size & 0xff);
+    lz.data[header + 5] = (uint8_t)(size >> 8);
+  }
+
+  // terminator is already zeroed
+  return lz;
+}
+
+#endif // ADAFRUIT_INTELLIKEYS_IK_EZUSB_IMAGE_H
@@ -23,7 +23,7 @@
  */
 
 // from https://github.com/ATMakersOrg/OpenIKeys/blob/master/original/IntelliKeys/WindowsOld/Win/Loading%20Driver/EzLoader_Firmware.c
-static const INTEL_HEX_RECORD ik_firmware[] = {
+static constexpr INTEL_HEX_RECORD ik_firmware[] = {
     16,
     0x1865,
     0,
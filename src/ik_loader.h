@@ -23,7 +23,7 @@
  */
 
 // From https://github.com/ATMakersOrg/OpenIKeys/blob/master/original/IntelliKeys/WindowsOld/Win/Loading%20Driver/loader.c
-static const INTEL_HEX_RECORD ik_loader[] = {
+static constexpr INTEL_HEX_RECORD ik_loader[] = {
     16,
     0x146c,
     0,
@@ -0,0 +1,82 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Ha Thach (tinyusb.org) for Adafruit Industries
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef ADAFRUIT_INTELLIKEYS_IK_SPSC_RING_H
+#define ADAFRUIT_INTELLIKEYS_IK_SPSC_RING_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Lock-free single producer, single consumer ring e.g between the core running
+// the USB host stack and the core sending HID reports. Only the producer
+// writes the head and only the consumer writes the tail, each side publishes
+// its index with release ordering after touching the slot. Only atomic load
+// and store are used, which are lock-free on Cortex-M0+ as well.
+//
+// DEPTH must be a power of 2, indices are free running and wrap naturally.
+template <typename T, uint32_t DEPTH> class IKSpscRing {
+  static_assert(DEPTH && !(DEPTH & (DEPTH - 1)), "DEPTH must be power of 2");
+
+public:
+  IKSpscRing(void) : _head(0), _tail(0) {}
+
+  // producer side
+  bool push(T const &item) {
+    uint32_t const head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) >= DEPTH) {
+      return false; // full
+    }
+
+    _buf[head & (DEPTH - 1)] = item;
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer side
+  bool pop(T *item) {
+    uint32_t const tail = _tail.load(std::memory_order_relaxed);
+    if (_head.load(std::memory_order_acquire) == tail) {
+      return false; // empty
+    }
+
+    *item = _buf[tail & (DEPTH - 1)];
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // approximate when called while the other side is running
+  uint32_t count(void) const {
+    return _head.load(std::memory_order_acquire) -
+           _tail.load(std::memory_order_acquire);
+  }
+
+  bool empty(void) const { return count() == 0; }
+
+private:
+  T _buf[DEPTH];
+  std::atomic<uint32_t> _head; // next slot to write, owned by producer
+  std::atomic<uint32_t> _tail; // next slot to read, owned by consumer
+};
+
+#endif // ADAFRUIT_INTELLIKEYS_IK_SPSC_RING_H
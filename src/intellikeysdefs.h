@@ -36,6 +36,9 @@ enum IK_LEDS {
 //  number of sensors
 #define IK_NUM_SENSORS 3
 
+//  number of LEDs, numbered from 1
+#define IK_NUM_LEDS 9
+
 //
 //  command codes sent to the device
 //  see firmware documentation for details